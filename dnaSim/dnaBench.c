@@ -0,0 +1,294 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    dnaBench.c
+
+Description:
+    Throughput and latency benchmark for the directNet client code, run
+    against an emulated PLC in the same process over a loopback TCP port
+    or a pseudo-terminal.
+
+Author:
+    Andrew Johnson
+
+******************************************************************************/
+
+/* OS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* libCom */
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+/* asyn */
+#include <asynDriver.h>
+#include <drvAsynIPPort.h>
+#include <drvAsynSerialPort.h>
+
+/* directNetAsyn */
+#include "directNetAsyn.h"
+#include "directNetClient.h"
+#include "plcEmu.h"
+
+#define BENCH_PORT	"dnaBench"
+#define BENCH_ID	1
+#define BENCH_ADDR	0x401	/* V2000 */
+#define BENCH_MAX_MSGS	64
+
+typedef struct benchMsg {
+    struct plcMessage msg;	/* Must be first */
+    epicsTimeStamp start;
+    char data[DN_RDDATA_LIMIT];
+} benchMsg;
+
+static struct {
+    int count;			/* Transactions per block size */
+    double writes;		/* Fraction of transactions that write */
+    int concurrency;		/* Messages kept queued */
+    epicsMutexId lock;		/* Protects issued .. latency */
+    epicsEventId done;
+    int size;
+    int issued;
+    int completed;
+    int nErrors;
+    unsigned int seed;
+    double *latency;
+} bench;
+
+static int benchCmd(void) {
+    int cmd = READVMEM;
+
+    bench.seed = bench.seed * 1103515245 + 12345;
+    if ((bench.seed >> 8) / (double) (1 << 24) < bench.writes)
+        cmd = WRITEVMEM;
+    return (BENCH_ID << 8) | cmd;
+}
+
+static void benchIssue(benchMsg *pbm) {
+    epicsMutexMustLock(bench.lock);
+    pbm->msg.cmd = benchCmd();
+    epicsMutexUnlock(bench.lock);
+    pbm->msg.len = bench.size;
+    epicsTimeGetCurrent(&pbm->start);
+    if (dnAsynClientSend(&pbm->msg)) {
+        pbm->msg.status = DN_INTERNAL;
+        pbm->msg.callback(&pbm->msg);
+    }
+}
+
+static void benchCallback(struct plcMessage *pMsg) {
+    benchMsg *pbm = (benchMsg *) pMsg;
+    epicsTimeStamp T_now;
+    int more, last;
+
+    epicsTimeGetCurrent(&T_now);
+    epicsMutexMustLock(bench.lock);
+    bench.latency[bench.completed++] = epicsTimeDiffInSeconds(&T_now,
+        &pbm->start);
+    if (pMsg->status)
+        bench.nErrors++;
+    more = bench.issued < bench.count;
+    if (more)
+        bench.issued++;
+    last = bench.completed == bench.count;
+    epicsMutexUnlock(bench.lock);
+
+    if (more)
+        benchIssue(pbm);
+    else if (last)
+        epicsEventSignal(bench.done);
+}
+
+static int benchCompare(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return da < db ? -1 : da > db;
+}
+
+static double benchPercentile(double fraction) {
+    return bench.latency[(int) (fraction * (bench.count - 1))] * 1000.0;
+}
+
+static void benchRun(benchMsg *msgs, int size) {
+    epicsTimeStamp T_start, T_end;
+    double secs;
+    int i;
+
+    bench.size = size;
+    bench.issued = bench.concurrency < bench.count ?
+        bench.concurrency : bench.count;
+    bench.completed = 0;
+    bench.nErrors = 0;
+
+    epicsTimeGetCurrent(&T_start);
+    for (i = 0; i < bench.issued; i++)
+        benchIssue(&msgs[i]);
+    epicsEventMustWait(bench.done);
+    epicsTimeGetCurrent(&T_end);
+    secs = epicsTimeDiffInSeconds(&T_end, &T_start);
+
+    qsort(bench.latency, bench.count, sizeof(double), benchCompare);
+    printf("%6d %6.2f %7d %7d %9.1f %10.0f %8.3f %8.3f %8.3f %8.3f\n",
+        size, bench.writes, bench.count, bench.nErrors,
+        bench.count / secs, bench.count * (double) size / secs,
+        benchPercentile(0.5), benchPercentile(0.9), benchPercentile(0.99),
+        bench.latency[bench.count - 1] * 1000.0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -P dn|sim   Protocol to test (sim)\n"
+        "  -n count    Transactions per block size (1000)\n"
+        "  -l sizes    Comma-separated block sizes in bytes (2,32,256,1024)\n"
+        "  -w frac     Fraction of transactions that write (0)\n"
+        "  -c count    Requests kept queued at once (1)\n"
+        "  -p depth    Simulator pipeline depth (0)\n"
+        "  -B          Use simulator binary data frames\n"
+        "  -s          Keep the DirectNet session between requests\n"
+        "  -b baud     Pace emulated link at this baud rate (unpaced)\n"
+        "  -t secs     PLC turnaround time (0)\n"
+        "  -e frac     Fraction of exchanges given errors (0)\n"
+        "  -S          Connect through a pseudo-terminal, not TCP\n"
+        "  -H host:port  Test an external simulator instead\n"
+        "  -H device   Test a serial PLC or pseudo-terminal instead\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *sizes = "2,32,256,1024";
+    const char *server = NULL;
+    const struct plcProto *proto = &simProto;
+    struct plcLink link;
+    plcEmu *emu;
+    benchMsg *msgs;
+    char host[32];
+    int opt, depth = 0, binary = 0, serial = 0, port, i;
+
+    memset(&link, 0, sizeof(link));
+    link.tmoMin = DN_TMO_MIN;
+    link.probePeriod = DN_PROBE_PERIOD;
+
+    emu = plcEmuCreate(EMU_PROTO_SIM);
+    if (!emu || !plcEmuAddSlave(emu, BENCH_ID)) {
+        fprintf(stderr, "dnaBench: Can't create emulated PLC\n");
+        return 1;
+    }
+    bench.count = 1000;
+    bench.concurrency = 1;
+
+    while ((opt = getopt(argc, argv, "P:n:l:w:c:p:Bsb:t:e:SH:h")) != -1) {
+        switch (opt) {
+        case 'P':
+            if (strcmp(optarg, "dn") == 0) {
+                proto = &dnpProto;
+                emu->proto = EMU_PROTO_DN;
+            }
+            else if (strcmp(optarg, "sim") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n': bench.count = atoi(optarg); break;
+        case 'l': sizes = optarg; break;
+        case 'w': bench.writes = atof(optarg); break;
+        case 'c': bench.concurrency = atoi(optarg); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'B': binary = 1; break;
+        case 's': link.session = 1; break;
+        case 'b': emu->link.baud = atof(optarg); break;
+        case 't': emu->link.turnaround = atof(optarg); break;
+        case 'e': emu->link.errorRate = atof(optarg); break;
+        case 'S': serial = 1; break;
+        case 'H': server = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (bench.count < 1)
+        bench.count = 1;
+    if (bench.concurrency < depth)
+        bench.concurrency = depth;
+    if (bench.concurrency < 1)
+        bench.concurrency = 1;
+    if (bench.concurrency > BENCH_MAX_MSGS)
+        bench.concurrency = BENCH_MAX_MSGS;
+
+    if (server)
+        serial = server[0] == '/';
+    else if (serial) {
+        server = plcEmuPty(emu);
+        if (!server)
+            return 1;
+    }
+    else {
+        port = plcEmuListen(emu, NULL, 0);
+        if (port < 0)
+            return 1;
+        sprintf(host, "127.0.0.1:%d", port);
+        server = host;
+    }
+    if (serial ? drvAsynSerialPortConfigure(BENCH_PORT, server, 0, 0, 0) :
+        drvAsynIPPortConfigure(BENCH_PORT, server, 0, 0, 0))
+        return 1;
+    if (proto == &simProto) {
+        if (depth && dnAsynClientPipeline(BENCH_PORT, depth))
+            return 1;
+        if (binary && dnAsynClientSimBinary(BENCH_PORT, 1))
+            return 1;
+    }
+
+    bench.lock = epicsMutexMustCreate();
+    bench.done = epicsEventMustCreate(epicsEventEmpty);
+    bench.latency = (double *) calloc(bench.count, sizeof(double));
+    msgs = (benchMsg *) calloc(bench.concurrency, sizeof(benchMsg));
+    if (!bench.latency || !msgs) {
+        fprintf(stderr, "dnaBench: calloc failed\n");
+        return 1;
+    }
+    for (i = 0; i < bench.concurrency; i++) {
+        struct plcMessage *pMsg = &msgs[i].msg;
+
+        pMsg->port = BENCH_PORT;
+        pMsg->proto = proto;
+        pMsg->link = &link;
+        pMsg->priority = DN_PRIO_MEDIUM;
+        pMsg->addr = BENCH_ADDR;
+        pMsg->pdata = msgs[i].data;
+        pMsg->callback = benchCallback;
+        if (initDnAsynClient(pMsg))
+            return 1;
+    }
+
+    printf("%s, %s protocol%s, %d queued, pipeline %d%s, baud %g, turnaround %g s, error rate %g\n",
+        server, proto == &dnpProto ? "DirectNet" : "Simulator",
+        link.session ? " with sessions" : "", bench.concurrency,
+        depth, binary ? ", binary" : "", emu->link.baud,
+        emu->link.turnaround, emu->link.errorRate);
+    printf("%6s %6s %7s %7s %9s %10s %8s %8s %8s %8s\n", "bytes", "writes",
+        "xacts", "errors", "xact/s", "bytes/s",
+        "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+    while (*sizes) {
+        char *end;
+        long size = strtol(sizes, &end, 0);
+
+        if (end == sizes || size < 1 || size > DN_RDDATA_LIMIT) {
+            fprintf(stderr, "dnaBench: Bad block size list at \"%s\"\n",
+                sizes);
+            return 1;
+        }
+        benchRun(msgs, (int) size);
+        sizes = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
@@ -0,0 +1,361 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    dnaSimServer.c
+
+Description:
+    Stand-alone PLC simulator serving the protocol in simProtocol.md, or
+    DirectNet over TCP, to any number of IOC connections at once, or over
+    a pseudo-terminal as a DirectNet serial line.
+
+Author:
+    Andrew Johnson
+
+******************************************************************************/
+
+/* OS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* libCom */
+#include <epicsAtomic.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+/* directNetAsyn */
+#include "directNetAsyn.h"
+#include "plcEmu.h"
+
+
+/* Scripted value changes
+ *
+ * Each line of a script file makes a change to one location every period
+ * seconds:
+ *     <period> <slave ID> <location> <action> [<args>]
+ * where the location is a V-memory word (V2000) or an input or output bit
+ * (X17, Y0), with the address in octal as usual, and the action is one of
+ *     set <value>
+ *     toggle
+ *     ramp <low> <high> <step>
+ *     random <low> <high>
+ * Blank lines and anything after a # are ignored.
+ */
+
+typedef struct simEvent {
+    struct simEvent *pNext;
+    double period;
+    epicsTimeStamp next;
+    plcEmuSlave *slave;
+    char space;			/* V, X or Y */
+    int offset;			/* Word or bit number */
+    enum {SIM_SET, SIM_TOGGLE, SIM_RAMP, SIM_RANDOM} action;
+    int low, high, step;
+} simEvent;
+
+static simEvent *simEvents;
+static size_t nChanges;
+
+static void simApply(simEvent *pev) {
+    plcEmuSlave *slave = pev->slave;
+    epicsUInt8 *pbyte;
+    int val, mask = 0;
+
+    epicsMutexMustLock(slave->lock);
+    if (pev->space == 'V') {
+        pbyte = &slave->vmem[pev->offset * 2];
+        val = pbyte[0] | (pbyte[1] << 8);
+    }
+    else {
+        pbyte = (pev->space == 'X' ? slave->inputs : slave->outputs) +
+            pev->offset / 8;
+        mask = 1 << (pev->offset % 8);
+        val = (*pbyte & mask) != 0;
+    }
+
+    switch (pev->action) {
+    case SIM_SET:
+        val = pev->low;
+        break;
+    case SIM_TOGGLE:
+        val = pev->space == 'V' ? ~val : !val;
+        break;
+    case SIM_RAMP:
+        val += pev->step;
+        if (val > pev->high || val < pev->low)
+            val = pev->step >= 0 ? pev->low : pev->high;
+        break;
+    case SIM_RANDOM:
+        val = pev->low + rand() % (pev->high - pev->low + 1);
+        break;
+    }
+
+    if (pev->space == 'V') {
+        pbyte[0] = val & 0xff;
+        pbyte[1] = (val >> 8) & 0xff;
+    }
+    else if (val)
+        *pbyte |= mask;
+    else
+        *pbyte &= ~mask;
+    epicsMutexUnlock(slave->lock);
+    epicsAtomicIncrSizeT(&nChanges);
+}
+
+static void simScriptThread(void *arg) {
+    simEvent *pev;
+
+    for (;;) {
+        epicsTimeStamp T_now, T_wake;
+        double delay;
+
+        epicsTimeGetCurrent(&T_now);
+        T_wake = T_now;
+        epicsTimeAddSeconds(&T_wake, 1.0);
+        for (pev = simEvents; pev; pev = pev->pNext) {
+            if (!epicsTimeLessThan(&T_now, &pev->next)) {
+                simApply(pev);
+                epicsTimeAddSeconds(&pev->next, pev->period);
+                /* Don't try to catch up after falling behind */
+                if (epicsTimeLessThan(&pev->next, &T_now)) {
+                    pev->next = T_now;
+                    epicsTimeAddSeconds(&pev->next, pev->period);
+                }
+            }
+            if (epicsTimeLessThan(&pev->next, &T_wake))
+                T_wake = pev->next;
+        }
+        delay = epicsTimeDiffInSeconds(&T_wake, &T_now);
+        if (delay > 0)
+            epicsThreadSleep(delay);
+    }
+}
+
+static int simScriptLine(plcEmu *emu, char *line, const char *file,
+    int lineno)
+{
+    simEvent *pev;
+    char location[32], action[16];
+    char *hash = strchr(line, '#');
+    char *end;
+    int id, n, args = 0;
+    long offset;
+    double period;
+
+    if (hash)
+        *hash = 0;
+    if (sscanf(line, " %31s", location) != 1)
+        return 0;
+
+    pev = (simEvent *) calloc(1, sizeof(simEvent));
+    if (!pev) {
+        fprintf(stderr, "dnaSimServer: calloc failed\n");
+        return -1;
+    }
+    if (sscanf(line, "%lf %d %31s %15s %n", &period, &id, location, action,
+            &n) != 4 || period <= 0)
+        goto bad_line;
+
+    pev->period = period;
+    pev->slave = plcEmuAddSlave(emu, id);
+    pev->space = location[0];
+    offset = strtol(location + 1, &end, 8);
+    if (!pev->slave || end == location + 1 || *end || offset < 0)
+        goto bad_line;
+    if ((pev->space == 'V' && offset >= EMU_VMEM_SIZE / 2) ||
+        ((pev->space == 'X' || pev->space == 'Y') &&
+            offset >= EMU_IO_SIZE * 8) ||
+        !strchr("VXY", pev->space))
+        goto bad_line;
+    pev->offset = offset;
+
+    line += n;
+    if (strcmp(action, "set") == 0) {
+        pev->action = SIM_SET;
+        args = sscanf(line, "%i", &pev->low) == 1;
+    }
+    else if (strcmp(action, "toggle") == 0) {
+        pev->action = SIM_TOGGLE;
+        args = 1;
+    }
+    else if (strcmp(action, "ramp") == 0) {
+        pev->action = SIM_RAMP;
+        args = sscanf(line, "%i %i %i", &pev->low, &pev->high,
+            &pev->step) == 3 && pev->low <= pev->high;
+    }
+    else if (strcmp(action, "random") == 0) {
+        pev->action = SIM_RANDOM;
+        args = sscanf(line, "%i %i", &pev->low, &pev->high) == 2 &&
+            pev->low <= pev->high;
+    }
+    if (!args)
+        goto bad_line;
+
+    epicsTimeGetCurrent(&pev->next);
+    pev->pNext = simEvents;
+    simEvents = pev;
+    return 0;
+
+bad_line:
+    fprintf(stderr, "dnaSimServer: Bad script line %s:%d\n", file, lineno);
+    free(pev);
+    return -1;
+}
+
+static int simScript(plcEmu *emu, const char *file) {
+    FILE *fp = fopen(file, "r");
+    char line[256];
+    int lineno = 0, status = 0;
+
+    if (!fp) {
+        fprintf(stderr, "dnaSimServer: Can't open \"%s\"\n", file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp))
+        status |= simScriptLine(emu, line, file, ++lineno);
+    fclose(fp);
+    return status;
+}
+
+
+/* Slave ID lists, like 1,2,10-20 */
+
+static int simSlaves(plcEmu *emu, const char *list) {
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 0), last = first;
+
+        if (end == list)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 0);
+            if (end == list)
+                return -1;
+        }
+        if (first < 0 || last >= EMU_SLAVES || first > last)
+            return -1;
+        while (first <= last) {
+            if (!plcEmuAddSlave(emu, first++))
+                return -1;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        list = end;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -P dn|sim   Protocol to serve (sim, or dn with -y)\n"
+        "  -a address  Interface to listen on (all)\n"
+        "  -p port     TCP port number (5000)\n"
+        "  -y link     Serve a pseudo-terminal instead, linked from here\n"
+        "  -s ids      Slave IDs to answer, like 1,2,10-20 (1)\n"
+        "  -f file     Script of value changes\n"
+        "  -r secs     Print request rates this often\n"
+        "  -b baud     Pace replies at this baud rate (unpaced)\n"
+        "  -t secs     Turnaround time before each reply (0)\n"
+        "  -e frac     Fraction of requests to fail (0)\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = "0.0.0.0", *slaves = "1", *script = NULL;
+    const char *link = NULL;
+    double rate = 0;
+    plcEmu *emu;
+    int opt, port = 5000, proto = -1;
+
+    emu = plcEmuCreate(EMU_PROTO_SIM);
+    if (!emu) {
+        fprintf(stderr, "dnaSimServer: calloc failed\n");
+        return 1;
+    }
+
+    while ((opt = getopt(argc, argv, "P:a:p:y:s:f:r:b:t:e:h")) != -1) {
+        switch (opt) {
+        case 'P':
+            if (strcmp(optarg, "dn") == 0)
+                proto = EMU_PROTO_DN;
+            else if (strcmp(optarg, "sim") == 0)
+                proto = EMU_PROTO_SIM;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a': address = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'y': link = optarg; break;
+        case 's': slaves = optarg; break;
+        case 'f': script = optarg; break;
+        case 'r': rate = atof(optarg); break;
+        case 'b': emu->link.baud = atof(optarg); break;
+        case 't': emu->link.turnaround = atof(optarg); break;
+        case 'e': emu->link.errorRate = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    if (proto >= 0)
+        emu->proto = proto;
+    else if (link)
+        emu->proto = EMU_PROTO_DN;
+
+    if (simSlaves(emu, slaves)) {
+        fprintf(stderr, "dnaSimServer: Bad slave ID list \"%s\"\n", slaves);
+        return 1;
+    }
+    if (script && simScript(emu, script))
+        return 1;
+    if (link) {
+        const char *device = plcEmuPty(emu);
+        struct stat st;
+
+        if (!device)
+            return 1;
+        /* Replace a link left behind by an earlier run */
+        if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+            unlink(link);
+        if (symlink(device, link)) {
+            fprintf(stderr, "dnaSimServer: Can't link %s to %s\n",
+                link, device);
+            return 1;
+        }
+        printf("Serving %s as %s\n", device, link);
+        fflush(stdout);
+    }
+    else if (plcEmuListen(emu, address, port) < 0)
+        return 1;
+    if (simEvents)
+        epicsThreadMustCreate("simScript", epicsThreadPriorityHigh,
+            epicsThreadGetStackSize(epicsThreadStackSmall),
+            simScriptThread, NULL);
+
+    for (;;) {
+        size_t requests = epicsAtomicGetSizeT(&emu->nRequests);
+        size_t changes = epicsAtomicGetSizeT(&nChanges);
+
+        epicsThreadSleep(rate > 0 ? rate : 60.0);
+        if (rate > 0) {
+            printf("%.1f requests/s, %.1f changes/s, %lu errors injected\n",
+                (epicsAtomicGetSizeT(&emu->nRequests) - requests) / rate,
+                (epicsAtomicGetSizeT(&nChanges) - changes) / rate,
+                (unsigned long) epicsAtomicGetSizeT(&emu->nFaults));
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,739 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    plcEmu.c
+
+Description:
+    Emulated DirectNet PLCs for testing and benchmarking the client code
+    without hardware or an external simulator, over TCP or a pseudo-terminal.
+
+Author:
+    Andrew Johnson
+
+******************************************************************************/
+
+/* For posix_openpt() etc, and cfmakeraw() which _XOPEN_SOURCE would hide */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+/* OS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* libCom */
+#include <epicsAtomic.h>
+#include <epicsThread.h>
+#include <errlog.h>
+
+/* directNetAsyn */
+#include "directNetAsyn.h"
+#include "plcEmu.h"
+
+
+/* Emulated memory */
+
+plcEmu * plcEmuCreate(int proto) {
+    plcEmu *emu = (plcEmu *) calloc(1, sizeof(plcEmu));
+
+    if (emu)
+        emu->proto = proto;
+    return emu;
+}
+
+plcEmuSlave * plcEmuAddSlave(plcEmu *emu, int id) {
+    plcEmuSlave *slave;
+
+    if (id < 0 || id >= EMU_SLAVES)
+        return NULL;
+    if (emu->slaves[id])
+        return emu->slaves[id];
+
+    slave = (plcEmuSlave *) calloc(1, sizeof(plcEmuSlave));
+    if (!slave)
+        return NULL;
+    slave->lock = epicsMutexMustCreate();
+    emu->slaves[id] = slave;
+    return slave;
+}
+
+int plcEmuAccess(plcEmu *emu, int id, int cmd, int addr,
+    epicsUInt8 *pdata, int len)
+{
+    plcEmuSlave *slave = (id >= 0 && id < EMU_SLAVES) ? emu->slaves[id] : NULL;
+    epicsUInt8 *base;
+    int size, offset = (addr - 1) * 2;
+
+    if (!slave)
+        return -1;
+
+    switch (cmd & 0xff & ~WRITECMD) {
+    case READVMEM:
+        base = slave->vmem;
+        size = EMU_VMEM_SIZE;
+        break;
+    case READINPS:
+        base = slave->inputs;
+        size = EMU_IO_SIZE;
+        break;
+    case READOUTS:
+        base = slave->outputs;
+        size = EMU_IO_SIZE;
+        break;
+    case READSPAD:
+        base = slave->spad;
+        size = EMU_SPAD_SIZE;
+        break;
+    default:
+        return -1;
+    }
+    if (offset < 0 || len < 0 || offset + len > size)
+        return -1;
+
+    epicsMutexMustLock(slave->lock);
+    if (cmd & WRITECMD)
+        memcpy(base + offset, pdata, len);
+    else
+        memcpy(pdata, base + offset, len);
+    epicsMutexUnlock(slave->lock);
+    return 0;
+}
+
+
+/* Connections */
+
+typedef struct emuConn {
+    plcEmu *emu;
+    int fd;
+    int binary;			/* Simulator binary frames agreed */
+    unsigned int seed;		/* For injected errors */
+    int head;			/* Next unread byte in buf */
+    int tail;			/* End of data in buf */
+    char buf[4096];
+    int outLen;			/* Replies held back in out */
+    char out[8192];
+} emuConn;
+
+static int emuSend(emuConn *pc, const char *pdata, size_t len);
+
+static int emuFlush(emuConn *pc) {
+    int len = pc->outLen;
+
+    pc->outLen = 0;
+    return len ? emuSend(pc, pc->out, len) : 0;
+}
+
+/* Incoming bytes are paced as they are taken from the stream. Replies
+ * held back are sent before waiting for more. */
+static int emuGetc(emuConn *pc) {
+    if (pc->head == pc->tail) {
+        ssize_t n;
+
+        if (emuFlush(pc))
+            return -1;
+        n = read(pc->fd, pc->buf, sizeof(pc->buf));
+        if (n <= 0)
+            return -1;
+        if (pc->emu->link.baud > 0)
+            epicsThreadSleep(n * 10.0 / pc->emu->link.baud);
+        pc->head = 0;
+        pc->tail = n;
+    }
+    return (unsigned char) pc->buf[pc->head++];
+}
+
+static int emuGets(emuConn *pc, char *pdata, int len) {
+    while (len-- > 0) {
+        int ch = emuGetc(pc);
+
+        if (ch < 0)
+            return -1;
+        *pdata++ = ch;
+    }
+    return 0;
+}
+
+/* Replies wait for the turnaround time, then the time to send them */
+static int emuSend(emuConn *pc, const char *pdata, size_t len) {
+    const plcEmuLink *link = &pc->emu->link;
+    double delay = link->turnaround;
+
+    if (link->baud > 0)
+        delay += len * 10.0 / link->baud;
+    if (delay > 0)
+        epicsThreadSleep(delay);
+
+    while (len > 0) {
+        ssize_t n = write(pc->fd, pdata, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        pdata += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Hold a reply back while more requests are already waiting, so the
+ * replies to pipelined requests that arrived together go out together */
+static int emuReply(emuConn *pc, const char *pdata, size_t len) {
+    if (pc->outLen + len > sizeof(pc->out) && emuFlush(pc))
+        return -1;
+    if (len > sizeof(pc->out))
+        return emuSend(pc, pdata, len);
+    memcpy(pc->out + pc->outLen, pdata, len);
+    pc->outLen += len;
+    return 0;
+}
+
+static int emuFault(emuConn *pc) {
+    double rate = pc->emu->link.errorRate;
+
+    if (rate <= 0)
+        return 0;
+    pc->seed = pc->seed * 1103515245 + 12345;
+    if ((pc->seed >> 8) / (double) (1 << 24) >= rate)
+        return 0;
+    epicsAtomicIncrSizeT(&pc->emu->nFaults);
+    return 1;
+}
+
+static int emuHexVal(int ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch + 10 - 'a';
+    if (ch >= 'A' && ch <= 'F')
+        return ch + 10 - 'A';
+    return -1;
+}
+
+static int emuHex(const char *pdata, int digits) {
+    int val = 0;
+
+    while (digits--) {
+        int nibble = emuHexVal(*pdata++);
+
+        if (nibble < 0)
+            return -1;
+        val = (val << 4) | nibble;
+    }
+    return val;
+}
+
+
+/* DirectNet slave
+ *
+ * The master selects a slave with SEQ id ENQ, then sends a header
+ * carrying 4 hex digits each of command, address and length, and 2 of
+ * its own ID. Data follows in blocks of up to BLOCK_LEN bytes, each
+ * acknowledged by the receiver or NAKed to have it sent again. A read
+ * ends with an EOT from the slave, every transaction with an EOT from
+ * the master. A block NAKed as often as the master tries is not sent
+ * again, as the master will have given up on it.
+ */
+
+#define EMU_DN_TRIES 3
+
+static void emuDnRead(emuConn *pc, int id, int cmd, int addr, int len) {
+    epicsUInt8 data[DN_RDDATA_LIMIT];
+    char frame[BLOCK_LEN + 3];
+    static const char eot = EOTCHAR;
+    int offset;
+
+    plcEmuAccess(pc->emu, id, cmd, addr, data, len);
+
+    for (offset = 0; offset < len; offset += BLOCK_LEN) {
+        int blen = len - offset > BLOCK_LEN ? BLOCK_LEN : len - offset;
+        char lrc = 0;
+        int i, reply, tries = 0;
+
+        frame[0] = STXCHAR;
+        for (i = 0; i < blen; i++)
+            lrc ^= frame[i + 1] = data[offset + i];
+        frame[blen + 1] = offset + blen < len ? ETBCHAR : ETXCHAR;
+        do {
+            frame[blen + 2] = emuFault(pc) ? ~lrc : lrc;
+            if (emuSend(pc, frame, blen + 3))
+                return;
+            reply = emuGetc(pc);
+        } while (reply == NAKCHAR && ++tries < EMU_DN_TRIES);
+        if (reply != ACKCHAR)
+            return;
+    }
+    emuSend(pc, &eot, 1);
+}
+
+static void emuDnWrite(emuConn *pc, int id, int cmd, int addr, int len) {
+    epicsUInt8 data[DN_RDDATA_LIMIT];
+    char frame[BLOCK_LEN + 2];
+    static const char ack = ACKCHAR, nak = NAKCHAR;
+    int offset = 0;
+
+    while (offset < len) {
+        int blen = len - offset > BLOCK_LEN ? BLOCK_LEN : len - offset;
+        char lrc = 0, last = offset + blen < len ? ETBCHAR : ETXCHAR;
+        int i, ch = emuGetc(pc);
+
+        if (ch != STXCHAR)
+            return;
+        if (emuGets(pc, frame, blen + 2))
+            return;
+        for (i = 0; i < blen; i++)
+            lrc ^= frame[i];
+        if (frame[blen] != last || frame[blen + 1] != lrc || emuFault(pc)) {
+            emuSend(pc, &nak, 1);
+            continue;
+        }
+        memcpy(data + offset, frame, blen);
+        offset += blen;
+        if (emuSend(pc, &ack, 1))
+            return;
+    }
+    plcEmuAccess(pc->emu, id, cmd, addr, data, len);
+}
+
+static void emuDnHeader(emuConn *pc, int id) {
+    static const char ack = ACKCHAR, nak = NAKCHAR;
+    epicsUInt8 probe[DN_RDDATA_LIMIT];
+    char header[HEADER_LEN - 1];
+    char lrc = 0;
+    int i, cmd, addr, len;
+
+    if (emuGets(pc, header, sizeof(header)))
+        return;
+    for (i = 0; i < HEADER_LEN - 3; i++)
+        lrc ^= header[i];
+    cmd = emuHex(header, 4);
+    addr = emuHex(header + 4, 4);
+    len = emuHex(header + 8, 4);
+
+    if (header[HEADER_LEN - 3] != ETBCHAR || header[HEADER_LEN - 2] != lrc ||
+        ((cmd >> 8) & 0xff) != id || len <= 0 || len > DN_RDDATA_LIMIT ||
+        plcEmuAccess(pc->emu, id, cmd & ~WRITECMD, addr, probe, len) ||
+        emuFault(pc)) {
+        emuSend(pc, &nak, 1);
+        return;
+    }
+    epicsAtomicIncrSizeT(&pc->emu->nRequests);
+    if (emuSend(pc, &ack, 1))
+        return;
+
+    if (cmd & WRITECMD)
+        emuDnWrite(pc, id, cmd, addr, len);
+    else
+        emuDnRead(pc, id, cmd, addr, len);
+}
+
+static void emuServeDn(emuConn *pc) {
+    int id = -1;
+    int ch;
+
+    while ((ch = emuGetc(pc)) >= 0) {
+        switch (ch) {
+        case SEQCHAR: {
+            int slave = emuGetc(pc);
+
+            id = -1;
+            if (emuGetc(pc) == ENQCHAR && slave >= SLAVEOFFSET &&
+                slave - SLAVEOFFSET < EMU_SLAVES &&
+                pc->emu->slaves[slave - SLAVEOFFSET]) {
+                char reply[3];
+
+                reply[0] = SEQCHAR;
+                reply[1] = slave;
+                reply[2] = ACKCHAR;
+                id = slave - SLAVEOFFSET;
+                emuSend(pc, reply, 3);
+            }
+            break;
+        }
+        case SOHCHAR:
+            if (id >= 0)
+                emuDnHeader(pc, id);
+            break;
+        case EOTCHAR:
+            /* The master has finished with the slave */
+            id = -1;
+            break;
+        default:
+            /* Line noise */
+            break;
+        }
+    }
+}
+
+
+/* Simulator protocol, see simProtocol.md */
+
+#define SIM_LINE 80
+
+static int emuGetLine(emuConn *pc, char *line) {
+    int len = 0;
+    int ch;
+
+    do {
+        ch = emuGetc(pc);
+    } while (ch == '\n' || ch == '\r');
+
+    while (ch >= 0 && ch != '\n' && ch != '\r') {
+        if (len + 1 < SIM_LINE)
+            line[len++] = ch;
+        ch = emuGetc(pc);
+    }
+    line[len] = 0;
+    return ch < 0 ? -1 : len;
+}
+
+/* Append a reply to buffer, with the tag if the request had one */
+static int emuSimReply(char *buffer, int tag, const char *reply) {
+    if (tag < 0)
+        return sprintf(buffer, "%s\n", reply);
+    if (reply[1])
+        return sprintf(buffer, "%c %2.2x%s\n", reply[0], tag, reply + 1);
+    return sprintf(buffer, "%c %2.2x\n", reply[0], tag);
+}
+
+static int emuSimData(emuConn *pc, char *buffer, int tag,
+    const epicsUInt8 *pdata, int len)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    char *next = buffer;
+
+    while (len > 0) {
+        int blen;
+
+        if (pc->binary) {
+            blen = len > DN_RDDATA_LIMIT ? DN_RDDATA_LIMIT : len;
+            if (tag < 0)
+                next += sprintf(next, "B %4.4x\n", blen);
+            else
+                next += sprintf(next, "B %2.2x %4.4x\n", tag, blen);
+            memcpy(next, pdata, blen);
+            next += blen;
+            pdata += blen;
+        }
+        else {
+            int i;
+
+            blen = len > 32 ? 32 : len;
+            if (tag < 0)
+                next += sprintf(next, "D %2.2x ", blen);
+            else
+                next += sprintf(next, "D %2.2x %2.2x ", tag, blen);
+            for (i = 0; i < blen; i++) {
+                *next++ = hexDigits[*pdata >> 4];
+                *next++ = hexDigits[*pdata++ & 0xf];
+            }
+            *next++ = '\n';
+        }
+        len -= blen;
+    }
+    return next - buffer;
+}
+
+/* Collect the data following a Write message */
+static int emuSimGetData(emuConn *pc, epicsUInt8 *pdata, int len) {
+    char line[SIM_LINE];
+    int got = 0;
+
+    while (got < len) {
+        int blen, i;
+
+        if (emuGetLine(pc, line) < 0)
+            return -1;
+        if (line[0] == 'B') {
+            blen = emuHex(line + 2, 4);
+            if (blen < 0 || got + blen > len)
+                return -1;
+            if (emuGets(pc, (char *) pdata + got, blen))
+                return -1;
+        }
+        else if (line[0] == 'D') {
+            blen = emuHex(line + 2, 2);
+            if (blen < 0 || got + blen > len)
+                return -1;
+            for (i = 0; i < blen; i++) {
+                int val = emuHex(line + 5 + 2 * i, 2);
+
+                if (val < 0)
+                    return -1;
+                pdata[got + i] = val;
+            }
+        }
+        else
+            return -1;
+        got += blen;
+    }
+    return 0;
+}
+
+static void emuServeSim(emuConn *pc) {
+    char line[SIM_LINE];
+    epicsUInt8 data[DN_RDDATA_LIMIT];
+    /* Room for the longest read in ASCII Data messages */
+    char reply[(DN_RDDATA_LIMIT / 32) * (2 + 3 + 3 + 64 + 1) + SIM_LINE];
+
+    while (emuGetLine(pc, line) >= 0) {
+        int id, cmd, addr, len, tag = -1;
+        char mode;
+        int n, rlen = 0;
+
+        switch (line[0]) {
+        case 'R':
+        case 'W':
+            n = sscanf(line + 1, "%x %x %x %x %x", &id, &cmd, &addr, &len,
+                &tag);
+            if (n < 4 || len < 0 || len > DN_RDDATA_LIMIT) {
+                rlen = emuSimReply(reply, n == 5 ? tag : -1, "N Bad request");
+                break;
+            }
+            if (n == 4)
+                tag = -1;
+            epicsAtomicIncrSizeT(&pc->emu->nRequests);
+            cmd = (id << 8) | (cmd & 0xff);
+            if (line[0] == 'W') {
+                if (emuSimGetData(pc, data, len))
+                    rlen = emuSimReply(reply, tag, "N Bad data");
+                else if (emuFault(pc))
+                    rlen = emuSimReply(reply, tag, "N Injected error");
+                else if (plcEmuAccess(pc->emu, id, cmd | WRITECMD, addr,
+                    data, len))
+                    rlen = emuSimReply(reply, tag, "N Address out of range");
+                else
+                    rlen = emuSimReply(reply, tag, "A");
+            }
+            else {
+                if (emuFault(pc))
+                    rlen = emuSimReply(reply, tag, "N Injected error");
+                else if (plcEmuAccess(pc->emu, id, cmd & ~WRITECMD, addr,
+                    data, len))
+                    rlen = emuSimReply(reply, tag, "N Address out of range");
+                else
+                    rlen = emuSimData(pc, reply, tag, data, len);
+            }
+            break;
+
+        case 'X':
+            /* Replies are complete before the next request is read */
+            if (sscanf(line + 1, "%x", &tag) != 1)
+                tag = -1;
+            rlen = emuSimReply(reply, tag, "A");
+            break;
+
+        case 'M':
+            if (sscanf(line + 1, " %c", &mode) == 1 &&
+                (mode == 'A' || mode == 'B')) {
+                pc->binary = (mode == 'B');
+                rlen = emuSimReply(reply, -1, "A");
+            }
+            else
+                rlen = emuSimReply(reply, -1, "N Unknown mode");
+            break;
+
+        case 'B':
+            /* Stray data, skip it */
+            len = emuHex(line + 2, 4);
+            while (len-- > 0 && emuGetc(pc) >= 0);
+            break;
+
+        case 'D':
+            break;
+
+        default:
+            rlen = emuSimReply(reply, -1, "N Unknown message");
+        }
+        if (rlen && emuReply(pc, reply, rlen))
+            return;
+    }
+}
+
+void plcEmuServe(plcEmu *emu, int fd) {
+    emuConn *pc = (emuConn *) calloc(1, sizeof(emuConn));
+
+    if (!pc) {
+        errlogPrintf("plcEmuServe: calloc failed\n");
+        return;
+    }
+    pc->emu = emu;
+    pc->fd = fd;
+    pc->seed = fd;
+
+    if (emu->proto == EMU_PROTO_DN)
+        emuServeDn(pc);
+    else
+        emuServeSim(pc);
+    free(pc);
+}
+
+
+/* TCP connections */
+
+typedef struct emuClient {
+    plcEmu *emu;
+    int fd;
+} emuClient;
+
+static void emuClientThread(void *arg) {
+    emuClient *pcl = (emuClient *) arg;
+
+    plcEmuServe(pcl->emu, pcl->fd);
+    close(pcl->fd);
+    free(pcl);
+}
+
+static void emuListenThread(void *arg) {
+    emuClient *plisten = (emuClient *) arg;
+
+    for (;;) {
+        int fd = accept(plisten->fd, NULL, NULL);
+        int one = 1;
+        emuClient *pcl;
+
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            errlogPrintf("plcEmuListen: accept failed, %s\n",
+                strerror(errno));
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pcl = (emuClient *) calloc(1, sizeof(emuClient));
+        if (!pcl) {
+            close(fd);
+            continue;
+        }
+        pcl->emu = plisten->emu;
+        pcl->fd = fd;
+        epicsThreadMustCreate("plcEmu", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            emuClientThread, pcl);
+    }
+    close(plisten->fd);
+    free(plisten);
+}
+
+int plcEmuListen(plcEmu *emu, const char *address, unsigned short port) {
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    emuClient *plisten;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        errlogPrintf("plcEmuListen: socket failed, %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (address && !inet_aton(address, &addr.sin_addr)) {
+        errlogPrintf("plcEmuListen: Bad address \"%s\"\n", address);
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, 16) ||
+        getsockname(fd, (struct sockaddr *) &addr, &alen)) {
+        errlogPrintf("plcEmuListen: Can't listen on port %u, %s\n",
+            port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    plisten = (emuClient *) calloc(1, sizeof(emuClient));
+    if (!plisten) {
+        close(fd);
+        return -1;
+    }
+    plisten->emu = emu;
+    plisten->fd = fd;
+    epicsThreadMustCreate("plcEmuListen", epicsThreadPriorityMedium,
+        epicsThreadGetStackSize(epicsThreadStackSmall),
+        emuListenThread, plisten);
+    return ntohs(addr.sin_port);
+}
+
+
+/* Pseudo-terminals */
+
+typedef struct emuPty {
+    plcEmu *emu;
+    int master;
+    int slave;
+    char *name;
+} emuPty;
+
+static void emuPtyThread(void *arg) {
+    emuPty *ppty = (emuPty *) arg;
+
+    plcEmuServe(ppty->emu, ppty->master);
+    errlogPrintf("plcEmuPty: Stopped serving %s\n", ppty->name);
+}
+
+const char * plcEmuPty(plcEmu *emu) {
+    struct termios tio;
+    emuPty *ppty;
+    const char *name;
+    int master;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master) ||
+        !(name = ptsname(master))) {
+        errlogPrintf("plcEmuPty: Can't create a pseudo-terminal, %s\n",
+            strerror(errno));
+        if (master >= 0)
+            close(master);
+        return NULL;
+    }
+
+    ppty = (emuPty *) calloc(1, sizeof(emuPty));
+    if (!ppty || !(ppty->name = strdup(name))) {
+        free(ppty);
+        close(master);
+        return NULL;
+    }
+    ppty->emu = emu;
+    ppty->master = master;
+    name = ppty->name;
+
+    /* Holding the slave side open stops reads from the master failing
+     * while no IOC has the device open, so IOCs can come and go. It also
+     * makes the line raw until an IOC sets its own modes. */
+    ppty->slave = open(name, O_RDWR | O_NOCTTY);
+    if (ppty->slave < 0 || tcgetattr(ppty->slave, &tio)) {
+        errlogPrintf("plcEmuPty: Can't open %s, %s\n", name,
+            strerror(errno));
+        if (ppty->slave >= 0)
+            close(ppty->slave);
+        close(master);
+        free(ppty->name);
+        free(ppty);
+        return NULL;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(ppty->slave, TCSANOW, &tio);
+
+    epicsThreadMustCreate("plcEmuPty", epicsThreadPriorityMedium,
+        epicsThreadGetStackSize(epicsThreadStackMedium),
+        emuPtyThread, ppty);
+    return name;
+}
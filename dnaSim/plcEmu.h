@@ -0,0 +1,91 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    plcEmu.h
+
+Description:
+    Emulated DirectNet PLCs, answering either the DirectNet serial protocol
+    or the simulator protocol of simProtocol.md on any connected stream.
+
+Author:
+    Andrew Johnson
+
+******************************************************************************/
+
+#ifndef INC_plcEmu_H
+#define INC_plcEmu_H
+
+#include <stddef.h>
+
+#include <epicsMutex.h>
+#include <epicsTypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Protocols */
+#define EMU_PROTO_DN	0	/* DirectNet slave */
+#define EMU_PROTO_SIM	1	/* Simulator, both ASCII and binary frames */
+
+/* Memory sizes in bytes; V-memory ends at V41237 as on a D2-260 */
+#define EMU_VMEM_SIZE	(0x42a0 * 2)
+#define EMU_IO_SIZE	0x400
+#define EMU_SPAD_SIZE	0x400
+
+#define EMU_SLAVES	256
+
+typedef struct plcEmuSlave {
+    epicsMutexId lock;		/* Protects the memory */
+    epicsUInt8 vmem[EMU_VMEM_SIZE];
+    epicsUInt8 inputs[EMU_IO_SIZE];
+    epicsUInt8 outputs[EMU_IO_SIZE];
+    epicsUInt8 spad[EMU_SPAD_SIZE];
+} plcEmuSlave;
+
+/* Link impairments, applied to every connection */
+typedef struct plcEmuLink {
+    double baud;		/* Bytes take 10 bits each, 0 = unpaced */
+    double turnaround;		/* Seconds before each reply */
+    double errorRate;		/* Fraction of exchanges to corrupt */
+} plcEmuLink;
+
+typedef struct plcEmu {
+    int proto;			/* EMU_PROTO_xxx */
+    plcEmuLink link;
+    plcEmuSlave *slaves[EMU_SLAVES];	/* Indexed by slave ID */
+    size_t nRequests;		/* Read and write requests seen */
+    size_t nFaults;		/* Errors injected */
+} plcEmu;
+
+extern plcEmu * plcEmuCreate(int proto);
+extern plcEmuSlave * plcEmuAddSlave(plcEmu *emu, int id);
+
+/* Copy data in or out of a slave's memory; cmd and addr are as sent by
+ * the IOC. Returns non-zero for an unknown slave, space or address. */
+extern int plcEmuAccess(plcEmu *emu, int id, int cmd, int addr,
+    epicsUInt8 *pdata, int len);
+
+/* Answer requests on an open stream until it is closed */
+extern void plcEmuServe(plcEmu *emu, int fd);
+
+/* Serve connections to a TCP port from a background thread, with a
+ * thread for each connection. The address is dotted-decimal, NULL for
+ * the loopback interface; port 0 picks a free one. Returns the port
+ * number, or -1 on error. */
+extern int plcEmuListen(plcEmu *emu, const char *address,
+    unsigned short port);
+
+/* Serve a new pseudo-terminal from a background thread, as if the PLCs
+ * were on the other end of a serial line. Returns the name of the
+ * device for the IOC to open, or NULL on error. */
+extern const char * plcEmuPty(plcEmu *emu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_plcEmu_H */
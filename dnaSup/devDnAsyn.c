@@ -25,6 +25,7 @@ Version:
 #include <alarm.h>
 #include <epicsMutex.h>
 #include <epicsString.h>
+#include <gpHash.h>
 #include <iocsh.h>
 
 /* IOC */
@@ -38,6 +39,7 @@ Version:
 #include <epicsExport.h>
 
 /* directNetAsyn */
+#include "directNetAsyn.h"
 #include "directNetClient.h"
 #include "devDnAsyn.h"
 
@@ -51,28 +53,51 @@ epicsExportAddress(int,devDnAsynDebug);
 
 static struct plcInfo *dnAsyn_plcs;
 
+/* Every PLC is indexed by name, and by port name plus slave ID */
+static struct gphPvt *dnAsyn_names;
+static struct gphPvt *dnAsyn_addrs;
+
+#define PLC_HASH_SIZE 256
+#define addrKey(slaveId) ((void *) (size_t) (slaveId))
+
 
 /* Find a named PLC */
 
 struct plcInfo * dnAsynPlc(const char* pname) {
-    struct plcInfo *pPlc = dnAsyn_plcs;
+    GPHENTRY *pent;
     
-    while (pPlc) {
-	if (strcmp(pname, pPlc->name) == 0)
-	    return pPlc;
-	pPlc = pPlc->pNext;
-    }
-    return NULL;
+    if (!dnAsyn_names)
+	return NULL;
+    pent = gphFind(dnAsyn_names, pname, NULL);
+    return pent ? (struct plcInfo *) pent->userPvt : NULL;
 }
 
 
 /* Parse an instio link field */
 
+/* Convert a priority name to DN_PRIO_xxx, returns -2 if not recognized */
+
+int dnAsynPriority(const char *name) {
+    static const char * const names[] = {"low", "medium", "high"};
+    int i;
+    
+    if (epicsStrCaseCmp(name, "auto") == 0)
+	return DN_PRIO_AUTO;
+    for (i=0; i < sizeof(names) / sizeof(names[0]); i++) {
+	if (epicsStrCaseCmp(name, names[i]) == 0)
+	    return DN_PRIO_LOW + i;
+    }
+    return -2;
+}
+
+
 int dnAsynAddr(struct dbCommon *prec, struct plcAddr *paddr, struct link *plink) {
     struct instio *pinstio;
     struct plcInfo *pPlc;
     unsigned int addr;
     char *parse;
+    char nameBuf[40], *name;
+    size_t len;
     int addrType = -1;
     int i;
     
@@ -107,19 +132,28 @@ int dnAsynAddr(struct dbCommon *prec, struct plcAddr *paddr, struct link *plink)
     /* check the string starts with a recognized PLC name */
     pinstio = &plink->value.instio;
     parse = pinstio->string;
-    for (pPlc = dnAsyn_plcs; pPlc; pPlc = pPlc->pNext) {
-	i = strlen(pPlc->name);
-	if ((strncmp(parse, pPlc->name, i) == 0) &&
-	    parse[i] == ' ') {
-	    parse += i + 1;
-	    break;
+    /* PLC names may contain spaces, so try each one in turn */
+    pPlc = NULL;
+    len = strcspn(parse, " ");
+    while (parse[len] == ' ') {
+	name = len < sizeof(nameBuf) ? nameBuf : malloc(len + 1);
+	if (name) {
+	    memcpy(name, parse, len);
+	    name[len] = 0;
+	    pPlc = dnAsynPlc(name);
+	    if (name != nameBuf)
+		free(name);
 	}
+	if (pPlc)
+	    break;
+	len += 1 + strcspn(parse + len + 1, " ");
     }
-    if ((pPlc == 0) || (parse == pinstio->string)) {
+    if (pPlc == 0) {
 	recGblRecordError(S_dev_badCard, (void *) prec,
 	    "devDnAsyn (init_record) named PLC not found");
 	return S_dev_badCard;
     }
+    parse += len + 1;
     paddr->plcInfo = pPlc;
     
     /* parse the PLC address type */
@@ -160,6 +194,24 @@ int dnAsynAddr(struct dbCommon *prec, struct plcAddr *paddr, struct link *plink)
 	    paddr->bitNum = 0;
     }
     
+    /* optional request priority, "prio=high" etc. */
+    paddr->priority = DN_PRIO_AUTO;
+    while (*parse == ' ') parse++;
+    if (epicsStrnCaseCmp(parse, "prio=", 5) == 0) {
+	char name[8];
+	
+	parse += 5;
+	for (i=0; i < sizeof(name) - 1 && parse[i] && parse[i] != ' '; i++)
+	    name[i] = parse[i];
+	name[i] = 0;
+	paddr->priority = dnAsynPriority(name);
+	if (paddr->priority < DN_PRIO_AUTO) {
+	    recGblRecordError(S_dev_badSignal, (void *) prec,
+		"devDnAsyn (init_record) priority must be low, medium or high");
+	    return S_dev_badSignal;
+	}
+    }
+    
     return 0;
 }
 
@@ -168,27 +220,31 @@ int dnAsynAddr(struct dbCommon *prec, struct plcAddr *paddr, struct link *plink)
 
 static int addPLC(const char* pname, int slaveId,
     const char* port, const struct plcProto *proto) {
-    struct plcInfo *pPlc = dnAsyn_plcs;
+    struct plcInfo *pPlc;
+    GPHENTRY *pent;
     
     if ((slaveId <= 0) || (slaveId > MAXDNSLAVEID)) {
 	printf("createDnAsynPLC: Slave ID out of range 1 .. %d\n", MAXDNSLAVEID);
 	return -1;
     }
     
+    if (!dnAsyn_names) {
+	gphInitPvt(&dnAsyn_names, PLC_HASH_SIZE);
+	gphInitPvt(&dnAsyn_addrs, PLC_HASH_SIZE);
+    }
+    
     /* Check for duplicates */
-    while (pPlc) {
-	if (strcmp(pname, pPlc->name) == 0) {
-	    printf("createDnAsynPLC: Duplicate name to PLC on port \"%s\" ID %u\n",
-		   pPlc->port, pPlc->slaveId);
-	    return -1;
-	}
-	if ((slaveId == pPlc->slaveId) &&
-	    (strcmp(port, pPlc->port) == 0)) {
-	    printf("createDnAsynPLC: Duplicate address to PLC \"%s\"\n",
-		   pPlc->name);
-	    return -1;
-	}
-	pPlc = pPlc->pNext;
+    pPlc = dnAsynPlc(pname);
+    if (pPlc) {
+	printf("createDnAsynPLC: Duplicate name to PLC on port \"%s\" ID %u\n",
+	       pPlc->port, pPlc->slaveId);
+	return -1;
+    }
+    pent = gphFind(dnAsyn_addrs, port, addrKey(slaveId));
+    if (pent) {
+	printf("createDnAsynPLC: Duplicate address to PLC \"%s\"\n",
+	       ((struct plcInfo *) pent->userPvt)->name);
+	return -1;
     }
     
     /* Create and populate a new info structure for this plc */
@@ -202,7 +258,27 @@ static int addPLC(const char* pname, int slaveId,
     pPlc->port    = epicsStrDup(port);
     pPlc->proto   = proto;
     pPlc->slaveId = slaveId;
-
+    pPlc->rdMax   = DN_RDDATA_MAX;
+    pPlc->xactCost = DN_XACT_COST;
+    pPlc->link.tmoMin = DN_TMO_MIN;
+    pPlc->link.probePeriod = DN_PROBE_PERIOD;
+    pPlc->rdPriority = DN_PRIO_AUTO;
+    pPlc->wrPriority = DN_PRIO_HIGH;
+
+    /* Index it; the entries use the strings in pPlc as their keys */
+    pent = gphAdd(dnAsyn_names, pPlc->name, NULL);
+    if (pent == NULL) {
+	printf("createDnAsynPLC: Can't index PLC \"%s\"\n", pname);
+	free((void *) pPlc->name);
+	free((void *) pPlc->port);
+	free(pPlc);
+	return -1;
+    }
+    pent->userPvt = pPlc;
+    pent = gphAdd(dnAsyn_addrs, pPlc->port, addrKey(slaveId));
+    if (pent)
+	pent->userPvt = pPlc;
+    
     /* Add it to the list */
     pPlc->pNext = dnAsyn_plcs;
     dnAsyn_plcs = pPlc;
@@ -221,9 +297,171 @@ int createDnAsynSimulatedPLC(const char* pname, int slaveId,
 }
 
 
+/* Configure optional PLC settings */
+
+int setDnAsynPLCOption(const char* pname, const char* key,
+    const char* value) {
+    struct plcInfo *pPlc;
+    char *end;
+    long lval;
+    
+    if (!pname || !key || !value) {
+	printf("Usage: setDnAsynPLCOption \"PLC name\", \"option\", \"value\"\n");
+	return -1;
+    }
+    
+    pPlc = dnAsynPlc(pname);
+    if (pPlc == NULL) {
+	printf("setDnAsynPLCOption: No PLC named \"%s\"\n", pname);
+	return -1;
+    }
+    
+    if (strcmp(key, "rdMax") == 0) {
+	/* Read block size in bytes, must be set before iocInit */
+	if (pPlc->rdCache) {
+	    printf("setDnAsynPLCOption: rdMax must be set before iocInit\n");
+	    return -1;
+	}
+	lval = strtol(value, &end, 0);
+	if ((end == value) ||
+	    (lval < DN_PLCWORDLEN * 2) || (lval > DN_RDDATA_LIMIT)) {
+	    printf("setDnAsynPLCOption: rdMax must be %d .. %d bytes\n",
+		   DN_PLCWORDLEN * 2, DN_RDDATA_LIMIT);
+	    return -1;
+	}
+	pPlc->rdMax = lval - (lval % DN_PLCWORDLEN);
+    } else if (strcmp(key, "xactCost") == 0) {
+	/* Read planner cost model, must be set before iocInit */
+	if (pPlc->rdCache) {
+	    printf("setDnAsynPLCOption: xactCost must be set before iocInit\n");
+	    return -1;
+	}
+	lval = strtol(value, &end, 0);
+	if ((end == value) || (lval < 0) || (lval > 10000)) {
+	    printf("setDnAsynPLCOption: xactCost must be 0 .. 10000 bytes\n");
+	    return -1;
+	}
+	pPlc->xactCost = lval;
+    } else if (strcmp(key, "rdWindow") == 0) {
+	/* Time to collect read requests before sending */
+	double dval = strtod(value, &end);
+	if ((end == value) || (dval < 0) || (dval > 1.0)) {
+	    printf("setDnAsynPLCOption: rdWindow must be 0 .. 1 seconds\n");
+	    return -1;
+	}
+	pPlc->rdWindow = dval;
+    } else if (strcmp(key, "wrWindow") == 0) {
+	/* Time to collect output writes before sending */
+	double dval = strtod(value, &end);
+	if ((end == value) || (dval < 0) || (dval > 1.0)) {
+	    printf("setDnAsynPLCOption: wrWindow must be 0 .. 1 seconds\n");
+	    return -1;
+	}
+	pPlc->wrWindow = dval;
+    } else if (strcmp(key, "timeoutMin") == 0) {
+	/* Shortest adaptive response timeout */
+	double dval = strtod(value, &end);
+	if ((end == value) || (dval < 0.001) || (dval > 60.0)) {
+	    printf("setDnAsynPLCOption: timeoutMin must be 0.001 .. 60 seconds\n");
+	    return -1;
+	}
+	pPlc->link.tmoMin = dval;
+    } else if (strcmp(key, "timeoutMax") == 0) {
+	/* Longest response timeout, 0 for the protocol's limits */
+	double dval = strtod(value, &end);
+	if ((end == value) || (dval < 0) || (dval > 60.0)) {
+	    printf("setDnAsynPLCOption: timeoutMax must be 0 .. 60 seconds\n");
+	    return -1;
+	}
+	pPlc->link.tmoMax = dval;
+    } else if (strcmp(key, "probePeriod") == 0) {
+	/* Time between probes of a PLC that is down, 0 never marks it down */
+	double dval = strtod(value, &end);
+	if ((end == value) || (dval < 0) || (dval > 3600.0)) {
+	    printf("setDnAsynPLCOption: probePeriod must be 0 .. 3600 seconds\n");
+	    return -1;
+	}
+	pPlc->link.probePeriod = dval;
+	if (dval == 0 && pPlc->link.health == plcDown)
+	    pPlc->link.health = plcSuspect;
+    } else if ((strcmp(key, "rdPriority") == 0) ||
+	       (strcmp(key, "wrPriority") == 0)) {
+	/* Default request priority for records without prio= */
+	int prio = dnAsynPriority(value);
+	if ((prio < DN_PRIO_AUTO) ||
+	    (key[0] == 'w' && prio == DN_PRIO_AUTO)) {
+	    printf("setDnAsynPLCOption: %s must be %slow, medium or high\n",
+		   key, key[0] == 'r' ? "auto, " : "");
+	    return -1;
+	}
+	if (key[0] == 'r')
+	    pPlc->rdPriority = prio;
+	else
+	    pPlc->wrPriority = prio;
+    } else if (strcmp(key, "session") == 0) {
+	/* Keep a DirectNet slave selected between back-to-back requests */
+	if (pPlc->proto != &dnpProto) {
+	    printf("setDnAsynPLCOption: session is only for DirectNet PLCs\n");
+	    return -1;
+	}
+	lval = strtol(value, &end, 0);
+	if ((end == value) || (lval < 0) || (lval > 1)) {
+	    printf("setDnAsynPLCOption: session must be 0 or 1\n");
+	    return -1;
+	}
+	pPlc->link.session = lval;
+    } else if (strcmp(key, "pipeline") == 0) {
+	/* Simulator requests in flight, must be set before iocInit */
+	if (pPlc->proto != &simProto) {
+	    printf("setDnAsynPLCOption: pipeline is only for simulated PLCs\n");
+	    return -1;
+	}
+	if (pPlc->rdSched || pPlc->wrCache) {
+	    printf("setDnAsynPLCOption: pipeline must be set before iocInit\n");
+	    return -1;
+	}
+	lval = strtol(value, &end, 0);
+	if ((end == value) || (lval < 0) || (lval > DN_PIPE_MAX)) {
+	    printf("setDnAsynPLCOption: pipeline must be 0 .. %d requests\n",
+		   DN_PIPE_MAX);
+	    return -1;
+	}
+	return dnAsynClientPipeline(pPlc->port, lval);
+    } else if (strcmp(key, "binary") == 0) {
+	/* Simulator data encoding, must be set before iocInit */
+	if (pPlc->proto != &simProto) {
+	    printf("setDnAsynPLCOption: binary is only for simulated PLCs\n");
+	    return -1;
+	}
+	if (pPlc->rdSched || pPlc->wrCache) {
+	    printf("setDnAsynPLCOption: binary must be set before iocInit\n");
+	    return -1;
+	}
+	lval = strtol(value, &end, 0);
+	if ((end == value) || (lval < 0) || (lval > 1)) {
+	    printf("setDnAsynPLCOption: binary must be 0 or 1\n");
+	    return -1;
+	}
+	return dnAsynClientSimBinary(pPlc->port, lval);
+    } else {
+	printf("setDnAsynPLCOption: Unknown option \"%s\"\n", key);
+	return -1;
+    }
+    return 0;
+}
+
+
 
 /* Report functions */
 
+static const char * const healthNames[] = {
+    "healthy", "suspect", "down"
+};
+
+static const char * const prioNames[] = {
+    "auto", "low", "medium", "high"
+};
+
 void dnAsynReport(int detail, dnPlcReportFn ioReport) {
     struct plcInfo *pPlc = dnAsyn_plcs;
     
@@ -239,6 +477,40 @@ void dnAsynReport(int detail, dnPlcReportFn ioReport) {
 			pPlc->alarm, pPlc->nRdReqs, pPlc->nWrReqs);
 		printf("    nSuccess = %lu, nDnFail = %lu, nAsynFail = %lu\n",
 			pPlc->nSuccess, pPlc->nDnFail, pPlc->nAsynFail);
+		printf("    rdMax = %hu, xactCost = %hu, rdWindow = %g, wrWindow = %g\n",
+			pPlc->rdMax, pPlc->xactCost, pPlc->rdWindow,
+			pPlc->wrWindow);
+		printf("    rdPriority = %s, wrPriority = %s\n",
+			prioNames[pPlc->rdPriority + 1],
+			prioNames[pPlc->wrPriority + 1]);
+		printf("    latency = %.1f ms, deviation = %.1f ms from %lu replies, %lu timeouts\n",
+			pPlc->link.mean * 1000.0, pPlc->link.dev * 1000.0,
+			pPlc->link.nSamples, pPlc->link.nTimeouts);
+		printf("    timeoutMin = %g, timeoutMax = %g\n",
+			pPlc->link.tmoMin, pPlc->link.tmoMax);
+		printf("    health = %s, probePeriod = %g, nTrips = %lu, nProbes = %lu, nFastFails = %lu\n",
+			healthNames[pPlc->link.health], pPlc->link.probePeriod,
+			pPlc->link.nTrips, pPlc->link.nProbes,
+			pPlc->link.nFastFails);
+		if (pPlc->link.session)
+		    printf("    session = 1, nResumed = %lu\n",
+			pPlc->link.nResumed);
+		{
+		    const struct dnHist *pq = &pPlc->link.stats.phase[dnPhaseQueue];
+		    const struct dnHist *ps = &pPlc->link.stats.phase[dnPhaseService];
+		    
+		    printf("    %lu transactions, mean queue wait = %.1f ms, service = %.1f ms\n",
+			(unsigned long) ps->count,
+			pq->count ? pq->sumUs / 1000.0 / pq->count : 0.0,
+			ps->count ? ps->sumUs / 1000.0 / ps->count : 0.0);
+		    printf("    txBytes = %lu, rxBytes = %lu\n",
+			(unsigned long) pPlc->link.stats.txBytes,
+			(unsigned long) pPlc->link.stats.rxBytes);
+		}
+		printf("    queued = %d, inFlight = %d, maxBacklog = %d, oldest = %.3f s\n",
+			pPlc->link.backlog.queued, pPlc->link.backlog.inFlight,
+			pPlc->link.backlog.maxBacklog,
+			dnAsynClientOldest(pPlc->port, &pPlc->link));
 		break;
 		
 	    default:
@@ -248,6 +520,23 @@ void dnAsynReport(int detail, dnPlcReportFn ioReport) {
 	
 	pPlc = pPlc->pNext;
     }
+    
+    if (detail == 1) {
+	/* Summarize each port once */
+	for (pPlc = dnAsyn_plcs; pPlc; pPlc = pPlc->pNext) {
+	    struct plcInfo *pPrev = dnAsyn_plcs;
+	    struct dnBacklog *pbl;
+	    
+	    while (pPrev != pPlc && strcmp(pPrev->port, pPlc->port) != 0)
+		pPrev = pPrev->pNext;
+	    pbl = dnAsynPortBacklog(pPlc->port);
+	    if (pPrev != pPlc || pbl == NULL) continue;
+	    
+	    printf("ASYN port \"%s\" queued = %d, inFlight = %d, maxBacklog = %d, oldest = %.3f s\n",
+		    pPlc->port, pbl->queued, pbl->inFlight, pbl->maxBacklog,
+		    dnAsynClientOldest(pPlc->port, NULL));
+	}
+    }
 }
 
 static long report(int detail) {
@@ -264,6 +553,9 @@ epicsExportAddress(drvet, drvDnAsyn);
 /* Command registry data:
  * 	createDnAsynPLC(const char* pname, int slaveId, const char* port)
  * 	dnAsynReport(int detail)
+ * 	createDnAsynSimulatedPLC(const char* pname, int slaveId, const char* port)
+ * 	setDnAsynPLCOption(const char* pname, const char* key, const char* value)
+ * 	dnAsynTraceDump(int count, const char* file)
  */
 static const iocshArg cmd0Arg0 = { "PLC name",iocshArgString};
 static const iocshArg cmd0Arg1 = { "directNet slave ID",iocshArgInt};
@@ -293,11 +585,36 @@ static void cmd2CallFunc(const iocshArgBuf *args)
     createDnAsynSimulatedPLC(args[0].sval, args[1].ival, args[2].sval);
 }
 
+static const iocshArg cmd3Arg0 = { "PLC name",iocshArgString};
+static const iocshArg cmd3Arg1 = { "option",iocshArgString};
+static const iocshArg cmd3Arg2 = { "value",iocshArgString};
+static const iocshArg * const cmd3Args[] =
+    {&cmd3Arg0,&cmd3Arg1,&cmd3Arg2};
+static const iocshFuncDef cmd3FuncDef =
+    {"setDnAsynPLCOption", 3, cmd3Args};
+static void cmd3CallFunc(const iocshArgBuf *args)
+{
+    setDnAsynPLCOption(args[0].sval, args[1].sval, args[2].sval);
+}
+
+static const iocshArg cmd4Arg0 = { "count",iocshArgInt};
+static const iocshArg cmd4Arg1 = { "file",iocshArgString};
+static const iocshArg * const cmd4Args[] =
+    {&cmd4Arg0,&cmd4Arg1};
+static const iocshFuncDef cmd4FuncDef =
+    {"dnAsynTraceDump", 2, cmd4Args};
+static void cmd4CallFunc(const iocshArgBuf *args)
+{
+    dnAsynTraceDump(args[0].ival, args[1].sval);
+}
+
 
 /* Registrar routine */
 void devDnAsynRegistrar(void) {
     iocshRegister(&cmd0FuncDef, cmd0CallFunc);
     iocshRegister(&cmd1FuncDef, cmd1CallFunc);
     iocshRegister(&cmd2FuncDef, cmd2CallFunc);
+    iocshRegister(&cmd3FuncDef, cmd3CallFunc);
+    iocshRegister(&cmd4FuncDef, cmd4CallFunc);
 }
 epicsExportRegistrar(devDnAsynRegistrar);
@@ -25,6 +25,8 @@ Version:
 #include <link.h>
 #include <shareLib.h>
 
+#include "directNetClient.h"
+
 
 #define PLCWORDBITS	16	/* Bits per Word */
 #define PLCWORDMASK	0xffff	/* All word bits set */
@@ -38,6 +40,9 @@ Version:
 #define WRITEMINADDR	02000	/* Don't write below V02000 */
 #define WRITEMAXADDR	02777	/* Don't write above V02777 */
 
+/* Request priority chosen from the record's SCAN setting */
+#define DN_PRIO_AUTO	-1
+
 
 typedef struct {
     dset common;
@@ -59,8 +64,16 @@ struct plcInfo {
     const char* port;
     unsigned short slaveId;
     unsigned short alarm;
+    unsigned short rdMax;	/* Max bytes in a read block */
+    unsigned short xactCost;	/* Overhead per transaction in bytes */
+    double rdWindow;		/* Delay to collect reads, in seconds */
+    double wrWindow;		/* Delay to collect writes, in seconds */
+    signed char rdPriority;	/* Default for reads, DN_PRIO_xxx */
+    signed char wrPriority;	/* Default for writes */
+    struct plcLink link;	/* Response latency and timeout limits */
     const struct plcProto *proto;
     struct rdCache *rdCache;
+    struct rdSched *rdSched;
     struct wrCache *wrCache;
     unsigned long nRdReqs;
     unsigned long nWrReqs;
@@ -74,6 +87,7 @@ struct plcAddr {
     struct plcInfo *plcInfo;
     unsigned short vAddr;
     unsigned char bitNum;
+    signed char priority;	/* From the link, DN_PRIO_AUTO if not given */
 };
 
 typedef void (*dnPlcReportFn)(int detail, struct plcInfo *pPlc);
@@ -86,10 +100,19 @@ epicsShareFunc int createDnAsynPLC(
 epicsShareFunc int createDnAsynSimulatedPLC(
     const char* pname, int slaveId, const char* port);
 
+epicsShareFunc int setDnAsynPLCOption(
+    const char* pname, const char* key, const char* value);
+
 epicsShareFunc struct plcInfo * dnAsynPlc(const char* pname);
+epicsShareFunc int dnAsynPriority(const char *name);
 epicsShareFunc int dnAsynAddr(
     struct dbCommon *prec, struct plcAddr *paddr, struct link *plink);
 epicsShareFunc void dnAsynReport(
     int detail, dnPlcReportFn ioReport);
 
+/* Input routines in devXiDnAsyn.c */
+
+epicsShareFunc int createDnAsynPoller(
+    const char* pname, double period, const char* addr);
+
 #endif /* INC_devDnAsyn_H */
@@ -0,0 +1,378 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    devDnAsynStats.c
+
+Description:
+    Device support for directNet over ASYN transaction statistics
+
+Author:
+    Andrew Johnson
+Version:
+    $Id$
+
+******************************************************************************/
+
+/* OS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* libCom */
+#include <alarm.h>
+#include <epicsAtomic.h>
+#include <epicsString.h>
+#include <epicsTime.h>
+#include <errlog.h>
+
+/* IOC */
+#include <dbCommon.h>
+#include <devSup.h>
+#include <link.h>
+#include <menuFtype.h>
+#include <recGbl.h>
+
+/* Records */
+#include <aiRecord.h>
+#include <longinRecord.h>
+#include <waveformRecord.h>
+
+#include <epicsExport.h>
+
+/* directNetAsyn */
+#include "devDnAsyn.h"
+#include "directNetAsyn.h"
+#include "directNetClient.h"
+
+
+/* The INP link is "@<PLC name> <statistic>" for the PLC's own figures, or
+ * "@<PLC name> port.<statistic>" for the Asyn port the PLC is on. Times
+ * are phase names, read as the mean in milliseconds by an ai record, as
+ * a transaction count by a longin, or as a histogram by a waveform.
+ * The backlog counts can be read by ai or longin records; the age of the
+ * oldest queued request is given in seconds and needs an ai.
+ */
+static const struct statDef {
+    const char *name;
+    enum statKind {PHASE, TXBYTES, RXBYTES, TXRATE, RXRATE, XACTRATE,
+	QUEUED, INFLIGHT, MAXBACKLOG, OLDEST} kind;
+    enum dnPhase phase;
+} statDefs[] = {
+    {"queue",    PHASE,    dnPhaseQueue},
+    {"select",   PHASE,    dnPhaseSelect},
+    {"header",   PHASE,    dnPhaseHeader},
+    {"data",     PHASE,    dnPhaseData},
+    {"eot",      PHASE,    dnPhaseEOT},
+    {"service",  PHASE,    dnPhaseService},
+    {"txBytes",  TXBYTES,  dnPhaseService},
+    {"rxBytes",  RXBYTES,  dnPhaseService},
+    {"txRate",   TXRATE,   dnPhaseService},
+    {"rxRate",   RXRATE,   dnPhaseService},
+    {"xactRate", XACTRATE, dnPhaseService},
+    {"queued",   QUEUED,   dnPhaseQueue},
+    {"inFlight", INFLIGHT, dnPhaseQueue},
+    {"maxBacklog", MAXBACKLOG, dnPhaseQueue},
+    {"oldest",   OLDEST,   dnPhaseQueue},
+};
+
+struct dpvtStats {
+    struct plcInfo *plcInfo;
+    int port;			/* Asyn port figures, not the PLC's */
+    const struct statDef *def;
+    struct dnStats *stats;	/* Port statistics appear at iocInit */
+    struct dnBacklog *backlog;
+    size_t lastCount;		/* Values at the last ai processing */
+    size_t lastSum;
+    epicsTimeStamp lastTime;
+};
+
+
+static long init_stats(struct dbCommon *prec, struct link *plink) {
+    struct dpvtStats *dpvt;
+    char *name, *stat;
+    int i;
+    
+    if (plink->type != INST_IO) {
+	recGblRecordError(S_dev_badBus, (void *) prec,
+	    "devDnAsynStats (init_record) Illegal Bus Type");
+	return S_dev_badBus;
+    }
+    
+    /* The statistic follows the last space */
+    name = epicsStrDup(plink->value.instio.string);
+    stat = strrchr(name, ' ');
+    if (stat == NULL) {
+	free(name);
+	recGblRecordError(S_dev_badSignal, (void *) prec,
+	    "devDnAsynStats (init_record) No statistic named");
+	return S_dev_badSignal;
+    }
+    *stat++ = 0;
+    
+    dpvt = (struct dpvtStats *) calloc(1, sizeof(struct dpvtStats));
+    if (dpvt == NULL) {
+	free(name);
+	recGblRecordError(S_dev_noMemory, (void *) prec,
+	    "devDnAsynStats (init_record) calloc failed");
+	return S_dev_noMemory;
+    }
+    
+    dpvt->plcInfo = dnAsynPlc(name);
+    if (dpvt->plcInfo == NULL) {
+	free(name);
+	free(dpvt);
+	recGblRecordError(S_dev_badCard, (void *) prec,
+	    "devDnAsynStats (init_record) named PLC not found");
+	return S_dev_badCard;
+    }
+    
+    if (strncmp(stat, "port.", 5) == 0) {
+	dpvt->port = TRUE;
+	stat += 5;
+    } else {
+	dpvt->stats = &dpvt->plcInfo->link.stats;
+	dpvt->backlog = &dpvt->plcInfo->link.backlog;
+    }
+    
+    for (i=0; i < sizeof(statDefs) / sizeof(statDefs[0]); i++) {
+	if (strcmp(stat, statDefs[i].name) == 0) {
+	    dpvt->def = &statDefs[i];
+	    break;
+	}
+    }
+    free(name);
+    if (dpvt->def == NULL) {
+	free(dpvt);
+	recGblRecordError(S_dev_badSignal, (void *) prec,
+	    "devDnAsynStats (init_record) Statistic not recognized");
+	return S_dev_badSignal;
+    }
+    
+    epicsTimeGetCurrent(&dpvt->lastTime);
+    prec->dpvt = dpvt;
+    return 0;
+}
+
+static struct dnStats * get_stats(struct dbCommon *prec) {
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    
+    if (!dpvt) return NULL;
+    if (!dpvt->stats) {
+	dpvt->stats = dnAsynPortStats(dpvt->plcInfo->port);
+	dpvt->backlog = dnAsynPortBacklog(dpvt->plcInfo->port);
+    }
+    if (!dpvt->stats)
+	recGblSetSevr(prec, READ_ALARM, INVALID_ALARM);
+    return dpvt->stats;
+}
+
+/* Current value of a backlog statistic */
+static double get_backlog(struct dpvtStats *dpvt) {
+    struct dnBacklog *pbl = dpvt->backlog;
+    
+    switch (dpvt->def->kind) {
+    case QUEUED:
+	return epicsAtomicGetIntT(&pbl->queued);
+    case INFLIGHT:
+	return epicsAtomicGetIntT(&pbl->inFlight);
+    case MAXBACKLOG:
+	return epicsAtomicGetIntT(&pbl->maxBacklog);
+    default:
+	return dnAsynClientOldest(dpvt->plcInfo->port,
+	    dpvt->port ? NULL : &dpvt->plcInfo->link);
+    }
+}
+
+
+/* ai records give averages and rates since they were last processed */
+
+static long init_ai(struct dbCommon *prec) {
+    struct aiRecord *pai = (struct aiRecord *) prec;
+    long status = init_stats(prec, &pai->inp);
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    
+    if (status) return status;
+    if (dpvt->def->kind == TXBYTES || dpvt->def->kind == RXBYTES) {
+	recGblRecordError(S_dev_badSignal, (void *) prec,
+	    "devDnAsynStats (init_record) Byte counts need a longin record");
+	prec->dpvt = NULL;
+	free(dpvt);
+	return S_dev_badSignal;
+    }
+    return 0;
+}
+
+static long read_ai(struct dbCommon *prec) {
+    struct aiRecord *pai = (struct aiRecord *) prec;
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    struct dnStats *pstats = get_stats(prec);
+    struct dnHist *phist;
+    epicsTimeStamp tNow;
+    size_t count, sum;
+    double interval;
+    
+    if (!pstats) return 2;
+    
+    if (dpvt->def->kind >= QUEUED) {
+	pai->val = get_backlog(dpvt);
+	prec->udf = FALSE;
+	return 2;
+    }
+    
+    phist = &pstats->phase[dpvt->def->phase];
+    epicsTimeGetCurrent(&tNow);
+    interval = epicsTimeDiffInSeconds(&tNow, &dpvt->lastTime);
+    switch (dpvt->def->kind) {
+    case TXRATE:
+	sum = epicsAtomicGetSizeT(&pstats->txBytes);
+	break;
+    case RXRATE:
+	sum = epicsAtomicGetSizeT(&pstats->rxBytes);
+	break;
+    default:
+	sum = epicsAtomicGetSizeT(&phist->sumUs);
+    }
+    count = epicsAtomicGetSizeT(&phist->count);
+    
+    switch (dpvt->def->kind) {
+    case PHASE:
+	/* Keep the old value if nothing happened */
+	if (count != dpvt->lastCount)
+	    pai->val = (sum - dpvt->lastSum) / 1000.0 /
+		       (count - dpvt->lastCount);
+	break;
+    case XACTRATE:
+	if (interval > 0)
+	    pai->val = (count - dpvt->lastCount) / interval;
+	break;
+    default:
+	if (interval > 0)
+	    pai->val = (sum - dpvt->lastSum) / interval;
+    }
+    
+    dpvt->lastCount = count;
+    dpvt->lastSum = sum;
+    dpvt->lastTime = tNow;
+    prec->udf = FALSE;
+    return 2;
+}
+
+
+/* longin records give running totals */
+
+static long init_li(struct dbCommon *prec) {
+    struct longinRecord *pli = (struct longinRecord *) prec;
+    long status = init_stats(prec, &pli->inp);
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    
+    if (status) return status;
+    switch (dpvt->def->kind) {
+    case TXRATE:
+    case RXRATE:
+    case XACTRATE:
+    case OLDEST:
+	recGblRecordError(S_dev_badSignal, (void *) prec,
+	    "devDnAsynStats (init_record) Rates and ages need an ai record");
+	prec->dpvt = NULL;
+	free(dpvt);
+	return S_dev_badSignal;
+    default:
+	break;
+    }
+    return 0;
+}
+
+static long read_li(struct dbCommon *prec) {
+    struct longinRecord *pli = (struct longinRecord *) prec;
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    struct dnStats *pstats = get_stats(prec);
+    
+    if (!pstats) return 0;
+    
+    switch (dpvt->def->kind) {
+    case TXBYTES:
+	pli->val = (epicsInt32) epicsAtomicGetSizeT(&pstats->txBytes);
+	break;
+    case RXBYTES:
+	pli->val = (epicsInt32) epicsAtomicGetSizeT(&pstats->rxBytes);
+	break;
+    case QUEUED:
+    case INFLIGHT:
+    case MAXBACKLOG:
+	pli->val = (epicsInt32) get_backlog(dpvt);
+	break;
+    default:
+	pli->val = (epicsInt32)
+	    epicsAtomicGetSizeT(&pstats->phase[dpvt->def->phase].count);
+    }
+    prec->udf = FALSE;
+    return 0;
+}
+
+
+/* waveform records give a phase's histogram, see directNetClient.h */
+
+static long init_wf(struct dbCommon *prec) {
+    struct waveformRecord *pwf = (struct waveformRecord *) prec;
+    long status = init_stats(prec, &pwf->inp);
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    
+    if (status) return status;
+    if (dpvt->def->kind != PHASE ||
+	(pwf->ftvl != menuFtypeLONG && pwf->ftvl != menuFtypeULONG &&
+	 pwf->ftvl != menuFtypeDOUBLE)) {
+	recGblRecordError(S_dev_badSignal, (void *) prec,
+	    "devDnAsynStats (init_record) Histograms need a phase and FTVL of LONG, ULONG or DOUBLE");
+	prec->dpvt = NULL;
+	free(dpvt);
+	return S_dev_badSignal;
+    }
+    return 0;
+}
+
+static long read_wf(struct dbCommon *prec) {
+    struct waveformRecord *pwf = (struct waveformRecord *) prec;
+    struct dpvtStats *dpvt = (struct dpvtStats *) prec->dpvt;
+    struct dnStats *pstats = get_stats(prec);
+    struct dnHist *phist;
+    epicsUInt32 i, n = pwf->nelm;
+    
+    if (!pstats) return 0;
+    
+    phist = &pstats->phase[dpvt->def->phase];
+    if (n > DN_HIST_BINS) n = DN_HIST_BINS;
+    for (i=0; i < n; i++) {
+	size_t bin = epicsAtomicGetSizeT(&phist->bins[i]);
+    
+	if (pwf->ftvl == menuFtypeDOUBLE)
+	    ((double *) pwf->bptr)[i] = bin;
+	else
+	    ((epicsUInt32 *) pwf->bptr)[i] = (epicsUInt32) bin;
+    }
+    pwf->nord = n;
+    prec->udf = FALSE;
+    return 0;
+}
+
+
+/* Device Support Entry Tables */
+
+XXDSET devAiDnAsynStats = {
+    { 6, NULL, NULL, init_ai, NULL},
+    read_ai, NULL
+};
+XXDSET devLiDnAsynStats = {
+    { 5, NULL, NULL, init_li, NULL},
+    read_li
+};
+XXDSET devWfDnAsynStats = {
+    { 5, NULL, NULL, init_wf, NULL},
+    read_wf
+};
+
+epicsExportAddress(dset, devAiDnAsynStats);
+epicsExportAddress(dset, devLiDnAsynStats);
+epicsExportAddress(dset, devWfDnAsynStats);
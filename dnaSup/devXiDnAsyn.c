@@ -19,14 +19,22 @@ Version:
 /* OS */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libCom */
 #include <alarm.h>
+#include <epicsAssert.h>
+#include <epicsAtomic.h>
+#include <epicsEvent.h>
 #include <epicsMath.h>
 #include <epicsMutex.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
 #include <errlog.h>
+#include <iocsh.h>
 
 /* IOC */
+#include <callback.h>
 #include <dbLock.h>
 #include <dbScan.h>
 #include <devSup.h>
@@ -49,62 +57,163 @@ Version:
 #include "directNetClient.h"
 
 
+/* Each read block's cache holds two copies of the data, each with the time
+ * and alarm severity of the read that filled it. The scheduler's callback,
+ * the only writer, fills the copy not in use and then increments seq to
+ * publish it. Readers copy what they need from snap[seq & 1] and try again
+ * if seq changed meanwhile, so they never wait for the writer or for each
+ * other. See rd_update() and rd_snapshot().
+ */
+struct rdSnap {
+    epicsTimeStamp timestamp;
+    unsigned short alarm;
+    unsigned short *data;		/* nWords */
+};
+
+/* A reader's copy of the words for one record */
+struct rdValue {
+    epicsTimeStamp timestamp;
+    unsigned short alarm;
+    unsigned short data[2];
+};
+
 struct rdCache {
     struct rdCache *pNext;
     struct rdItem {
-	struct plcMessage msg;		/* *MUST* be first, see devXiDnCallback */
-	epicsMutexId msgMutex;		/* Protects msgData .. active */
-	char msgData[DN_RDDATA_MAX];	/* This is the I/O buffer */
+	struct rdSched *sched;
+	struct rdItem *schedNext;	/* Protected by sched->mutex */
 	unsigned int startAddr;
-	unsigned char nWords;
-	unsigned char active;
-	epicsMutexId cacheMutex;	/* Protects data .. timestamp */
-	unsigned short data[DN_RDDATA_MAX / DN_PLCWORDLEN];	/* data cache */
-	epicsTimeStamp timestamp;
+	unsigned short nWords;
+	unsigned char active;		/* Protected by sched->mutex */
+	unsigned char prio;		/* Protected by sched->mutex */
+	int seq;			/* Updates published */
+	struct rdSnap snap[2];		/* Current one is snap[seq & 1] */
 	IOSCANPVT intInfo;
 	struct dpvtIn *recList;
+	EpicsAtomicPtrT waiters;	/* dpvtIn stack, see rd_wait() */
+	double pollPeriod;		/* Zero if not polled */
+	epicsTimeStamp pollDue;		/* Protected by poller->mutex */
+	struct rdItem *pollNext;
+	unsigned char polled;		/* On pollNext list, ditto */
     } item;
 };
 
+/* All reads from one PLC go through its rdSched. Blocks that need to be
+ * read are put on the pending list in address order, and each time the
+ * scheduler's message gets to the front of the asyn queue its prepare
+ * routine takes the first pending block with the highest priority plus
+ * any others adjacent to it that fit in the same transaction, so blocks
+ * that went stale together get read together. Gaps between blocks are
+ * never read, the planner already decided they weren't worth it. The
+ * message is queued at the highest priority of the pending blocks.
+ */
+struct rdSched {
+    struct plcMessage msg;	/* *MUST* be first, see devXiDnCallback */
+    struct plcInfo *plcInfo;
+    epicsMutexId mutex;		/* Protects pending .. active */
+    struct rdItem *pending;	/* Blocks to be read, in address order */
+    struct rdItem *reading;	/* Blocks in the current transaction */
+    unsigned char active;	/* Message is queued or being processed */
+    CALLBACK window;		/* Delays the first request */
+    unsigned long nXacts;
+    unsigned long nMerged;
+    struct rdItem **index;	/* All blocks in address order */
+    int nIndex;
+    char msgData[DN_RDDATA_LIMIT];	/* This is the I/O buffer */
+};
+
 struct dpvtIn {
     struct dbCommon *precord;
     enum recType {AI, AIF, BI, MBBI, MBBID} type;
-    unsigned char waiting;
+    int waiting;		/* RD_IDLE etc, see rd_wait() */
     struct plcAddr plcAddr;
     struct plcInfo *plcInfo;
     struct rdItem *rdItem;
     struct dpvtIn *recNext;
+    struct dpvtIn *waitNext;	/* On rdItem->waiters */
     epicsTimeStamp start;
+    CALLBACK process;		/* Completes an asynchronous read */
 };
 
+/* One background poller per asyn port, see createDnAsynPoller() */
+struct dnPoller {
+    struct dnPoller *pNext;
+    const char *port;
+    epicsMutexId mutex;		/* Protects items list and pollDue */
+    epicsEventId wakeup;
+    struct rdItem *items;
+    unsigned long nPolls;
+};
+
+static struct dnPoller *pollers;
+
 static const char *recTypeName[] = {
     "ai", "ai[Float]", "bi", "mbbi", "mbbiDirect"
 };
 
+static void rd_snapshot(const struct rdItem *pitem, unsigned int offset,
+    int nWords, struct rdValue *pval) {
+    int seq;
+    
+    do {
+	const struct rdSnap *psnap;
+	int i;
+	
+	seq = epicsAtomicGetIntT(&pitem->seq);
+	epicsAtomicReadMemoryBarrier();
+	psnap = &pitem->snap[seq & 1];
+	pval->timestamp = psnap->timestamp;
+	pval->alarm = psnap->alarm;
+	for (i = 0; i < nWords; i++)
+	    pval->data[i] = psnap->data[offset + i];
+	epicsAtomicReadMemoryBarrier();
+    } while (epicsAtomicGetIntT(&pitem->seq) != seq);
+}
+
 static void ioReport(int detail, struct plcInfo *pPlc) {
     struct rdCache *pcache = pPlc->rdCache;
+    struct rdSched *psched = pPlc->rdSched;
     
+    if (psched && detail == 2) {
+	struct dnPoller *ppoll;
+	
+	printf("    RdSched made %lu transactions, %lu blocks merged\n",
+	       psched->nXacts, psched->nMerged);
+	for (ppoll = pollers; ppoll; ppoll = ppoll->pNext) {
+	    if (strcmp(ppoll->port, pPlc->port) == 0)
+		printf("    Poller for port \"%s\" has requested %lu reads\n",
+		       ppoll->port, ppoll->nPolls);
+	}
+    }
     while (pcache) {
 	switch (detail) {
 	case 2: {
+	    struct rdValue val;
 	    char when[64];
+	    
+	    rd_snapshot(&pcache->item, 0, 0, &val);
 	    epicsTimeToStrftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S.%06f",
-				&pcache->item.timestamp);
+				&val.timestamp);
 	    printf("    RdCache for V%o - V%o last updated at %s\n",
 		   pcache->item.startAddr - DNREFOFFSET,
 		   pcache->item.startAddr - DNREFOFFSET + pcache->item.nWords - 1,
 		   when);
+	    if (pcache->item.pollPeriod > 0)
+		printf("        polled every %g seconds\n",
+		       pcache->item.pollPeriod);
 	    }
 	    break;
 	    
 	case 3: {
+		const struct rdSnap *psnap = &pcache->item.snap[
+		    epicsAtomicGetIntT(&pcache->item.seq) & 1];
 		int i;
 		
 		printf("    RdCache buffer for V%o - V%o holds (hex):\n       ",
 			pcache->item.startAddr - DNREFOFFSET,
 			pcache->item.startAddr - DNREFOFFSET + pcache->item.nWords - 1);
 		for (i=0; i < pcache->item.nWords; i++) {
-		    printf(" %04x", pcache->item.data[i]);
+		    printf(" %04x", psnap->data[i]);
 		}
 		putchar('\n');
 	    }
@@ -145,24 +254,221 @@ static long report(int detail) {
 
 
 static void devXiDnConnstat(struct plcMessage *pMsg, int connected) {
-    /* This uses a kludge, we actually need the address of the struct rdItem.
+    /* This uses a kludge, we actually need the address of the struct rdSched.
      * The two must be identical or this will fail. */
-    struct rdItem *pitem = (struct rdItem *) pMsg;
-    struct dpvtIn *dpvt = pitem->recList;
-    struct plcInfo *pPlc = dpvt->plcInfo;
+    struct rdSched *psched = (struct rdSched *) pMsg;
+    struct plcInfo *pPlc = psched->plcInfo;
     
     errlogPrintf("devDnAsyn: Asyn port \"%s\" %sconnected (PLC \"%s\")\n", 
 		 pMsg->port, connected ? "" : "dis", pPlc->name);
 }
 
+static int devXiDnPrepare(struct plcMessage *pMsg) {
+    /* This uses a kludge, we actually need the address of the struct rdSched.
+     * The two must be identical or this will fail. */
+    struct rdSched *psched = (struct rdSched *) pMsg;
+    struct plcInfo *pPlc = psched->plcInfo;
+    const unsigned int maxWords = pPlc->rdMax / DN_PLCWORDLEN;
+    struct rdItem *pitem, **ppitem, **ppread;
+    unsigned int start, end;
+    
+    epicsMutexMustLock(psched->mutex);
+    if (psched->pending == NULL) {
+	epicsMutexUnlock(psched->mutex);
+	return -1;
+    }
+    
+    /* The first pending block of the highest priority starts the
+     * transaction */
+    ppread = &psched->pending;
+    for (ppitem = &(*ppread)->schedNext; *ppitem;
+	 ppitem = &(*ppitem)->schedNext) {
+	if ((*ppitem)->prio > (*ppread)->prio)
+	    ppread = ppitem;
+    }
+    ppitem = ppread;
+    pitem = *ppitem;
+    start = pitem->startAddr;
+    end = start + pitem->nWords;
+    *ppitem = pitem->schedNext;
+    pitem->schedNext = NULL;
+    psched->reading = pitem;
+    ppread = &pitem->schedNext;
+    
+    /* Add any following blocks that are adjacent */
+    while ((pitem = *ppitem) && pitem->startAddr <= end) {
+	unsigned int iend = pitem->startAddr + pitem->nWords;
+	
+	if (iend > end) {
+	    if (iend - start > maxWords) {
+		ppitem = &pitem->schedNext;
+		continue;
+	    }
+	    end = iend;
+	}
+	*ppitem = pitem->schedNext;
+	pitem->schedNext = NULL;
+	*ppread = pitem;
+	ppread = &pitem->schedNext;
+	psched->nMerged++;
+    }
+    psched->nXacts++;
+    epicsMutexUnlock(psched->mutex);
+    
+    pMsg->addr = start;
+    pMsg->len  = (end - start) * PLCWORDBYTES;
+    pPlc->nRdReqs++;
+    
+    if (devDnAsynDebug >= 10)
+	printf("devXiDnAsyn: Reading V%o - V%o from PLC \"%s\"\n",
+	       start - DNREFOFFSET, end - 1 - DNREFOFFSET, pPlc->name);
+    return 0;
+}
+
+/* More blocks waiting means devXiDnCallback will queue the message again */
+static int devXiDnMore(struct plcMessage *pMsg) {
+    struct rdSched *psched = (struct rdSched *) pMsg;
+    int more;
+    
+    epicsMutexMustLock(psched->mutex);
+    more = (psched->pending != NULL);
+    epicsMutexUnlock(psched->mutex);
+    return more;
+}
+
+/* Records waiting for a block to be read
+ *
+ * A record that needs a read pushes itself onto the block's waiters stack,
+ * and rd_update() takes the whole stack once the data is in, so it only
+ * visits the records that asked for it. Both sides are lock-free. A record
+ * whose read request failed stays on the stack until the next update, but
+ * marked RD_DROPPED so it doesn't get processed then; it can start waiting
+ * again meanwhile without being pushed twice.
+ */
+#define RD_IDLE		0	/* Not on the stack */
+#define RD_WAITING	1	/* On the stack, process when read */
+#define RD_DROPPED	2	/* On the stack, request failed */
+
+static void rd_wait(struct rdItem *pitem, struct dpvtIn *dpvt) {
+    for (;;) {
+	if (epicsAtomicCmpAndSwapIntT(&dpvt->waiting,
+		RD_IDLE, RD_WAITING) == RD_IDLE)
+	    break;
+	if (epicsAtomicCmpAndSwapIntT(&dpvt->waiting,
+		RD_DROPPED, RD_WAITING) == RD_DROPPED)
+	    return;			/* Still on the stack */
+    }
+    
+    for (;;) {
+	EpicsAtomicPtrT head = epicsAtomicGetPtrT(&pitem->waiters);
+	
+	dpvt->waitNext = (struct dpvtIn *) head;
+	if (epicsAtomicCmpAndSwapPtrT(&pitem->waiters, head, dpvt) == head)
+	    return;
+    }
+}
+
+static struct dpvtIn * rd_waiters(struct rdItem *pitem) {
+    for (;;) {
+	EpicsAtomicPtrT head = epicsAtomicGetPtrT(&pitem->waiters);
+	
+	if (head == NULL ||
+	    epicsAtomicCmpAndSwapPtrT(&pitem->waiters, head, NULL) == head)
+	    return (struct dpvtIn *) head;
+    }
+}
+
+static void rd_update(struct rdItem *pitem, struct plcMessage *pMsg,
+    unsigned short alarm) {
+    struct dpvtIn *dpvt, *pnext;
+    int seq = pitem->seq;	/* Only we change it */
+    const struct rdSnap *pold = &pitem->snap[seq & 1];
+    struct rdSnap *pnew = &pitem->snap[(seq + 1) & 1];
+    int i;
+    
+    if (alarm == NO_ALARM) {
+	const char *pdata = pMsg->pdata +
+	    (pitem->startAddr - pMsg->addr) * PLCWORDBYTES;
+	
+	/* Cache the reply data */
+	for (i=0; i < pitem->nWords; i++) {
+	    pnew->data[i] = ((0xff & pdata[2*i+1]) << 8) |
+			     (0xff & pdata[2*i]);
+	}
+    } else {
+	/* Keep the last good data */
+	memcpy(pnew->data, pold->data, pitem->nWords * sizeof(pnew->data[0]));
+    }
+    pnew->alarm = alarm;
+    /* Update timestamp even on error so I/O Intr records don't retry I/O */
+    epicsTimeGetCurrent(&pnew->timestamp);
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetIntT(&pitem->seq, seq + 1);
+    
+    epicsMutexMustLock(pitem->sched->mutex);
+    pitem->active = FALSE;
+    epicsMutexUnlock(pitem->sched->mutex);
+    
+    /* Now complete all the waiting records. They get processed by the
+     * callback threads at their own priority, so the port can get on with
+     * the next transaction meanwhile. */
+    for (dpvt = rd_waiters(pitem); dpvt != NULL; dpvt = pnext) {
+	struct dbCommon *prec = dpvt->precord;
+	
+	pnext = dpvt->waitNext;	/* Before it can be pushed again */
+	if (devDnAsynDebug >= 15) {
+	    printf("Examining \"%s\", waiting = %d\n", prec->name, dpvt->waiting);
+	}
+	for (;;) {
+	    if (epicsAtomicCmpAndSwapIntT(&dpvt->waiting,
+		    RD_DROPPED, RD_IDLE) == RD_DROPPED)
+		break;
+	    if (epicsAtomicCmpAndSwapIntT(&dpvt->waiting,
+		    RD_WAITING, RD_IDLE) != RD_WAITING)
+		continue;
+	    
+	    if (callbackRequestProcessCallback(&dpvt->process, prec->prio, prec)) {
+		/* Callback queue full, do it here instead */
+		rset *prset = prec->rset;
+		
+		dbScanLock(prec);
+		(*prset->process)(prec);
+		dbScanUnlock(prec);
+	    }
+	    break;
+	}
+    }
+    
+    /* Finally trigger any I/O Interrupt records */
+    scanIoRequest(pitem->intInfo);
+}
+
+static void rd_next(struct rdSched *psched);
+
 static void devXiDnCallback(struct plcMessage *pMsg) {
-    /* This uses a kludge, we actually need the address of the struct rdItem.
+    /* This uses a kludge, we actually need the address of the struct rdSched.
      * The two must be identical or this will fail. */
-    struct rdItem *pitem = (struct rdItem *) pMsg;
-    struct dpvtIn *dpvt = pitem->recList;
-    struct plcInfo *pPlc = dpvt->plcInfo;
+    struct rdSched *psched = (struct rdSched *) pMsg;
+    struct plcInfo *pPlc = psched->plcInfo;
+    struct rdItem *pitem, *pnext;
     int i;
     
+    epicsMutexMustLock(psched->mutex);
+    pitem = psched->reading;
+    psched->reading = NULL;
+    if (pitem == NULL && pMsg->status != DN_SUCCESS) {
+	/* The request timed out in the queue, fail all pending blocks */
+	pitem = psched->pending;
+	psched->pending = NULL;
+    }
+    epicsMutexUnlock(psched->mutex);
+    
+    if (pitem == NULL) {
+	/* Nothing was pending, no I/O done */
+	rd_next(psched);
+	return;
+    }
+    
     if (devDnAsynDebug >= 10) {
 	printf("devXiDnAsyn: Got a reply from PLC \"%s\"\n", 
 		pPlc->name);
@@ -176,6 +482,10 @@ static void devXiDnCallback(struct plcMessage *pMsg) {
 	/* Read succeeded */
 	pPlc->alarm = NO_ALARM;
 	pPlc->nSuccess++;
+    } else if (pMsg->status == DN_PLC_DOWN) {
+	/* Failed at once, directNetClient logged the PLC going down */
+	pPlc->alarm = INVALID_ALARM;
+	pPlc->nDnFail++;
     } else if (pMsg->status > DN_TIMEOUT) {
 	/* DirectNet I/O problem */
 	errlogPrintf("devXiDnAsyn: DirectNet error %s from PLC \"%s\" on Asyn port \"%s\"\n",
@@ -200,193 +510,687 @@ static void devXiDnCallback(struct plcMessage *pMsg) {
 	}
 	printf("\n");
     }
+    
+    /* Fan the data out to all the blocks that were read */
+    for (; pitem; pitem = pnext) {
+	pnext = pitem->schedNext;
+	rd_update(pitem, pMsg, pPlc->alarm);
+    }
+    
+    rd_next(psched);
+}
 
-    epicsMutexMustLock(pitem->msgMutex);
-    epicsMutexMustLock(pitem->cacheMutex);
-    if (pPlc->alarm == NO_ALARM) {
-	/* Cache the reply data */
-	for (i=0; i < pitem->nWords; i++) {
-	    pitem->data[i] = ((0xff & pMsg->pdata[2*i+1]) << 8) |
-			      (0xff & pMsg->pdata[2*i]);
+static void rd_next(struct rdSched *psched) {
+    struct rdItem *pitem;
+    
+    epicsMutexMustLock(psched->mutex);
+    if (psched->pending == NULL) {
+	psched->active = FALSE;
+	epicsMutexUnlock(psched->mutex);
+	return;
+    }
+    psched->msg.priority = DN_PRIO_LOW;
+    for (pitem = psched->pending; pitem; pitem = pitem->schedNext) {
+	if (pitem->prio > psched->msg.priority)
+	    psched->msg.priority = pitem->prio;
+    }
+    if (dnAsynClientSend(&psched->msg) == 0) {
+	epicsMutexUnlock(psched->mutex);
+	return;
+    }
+    
+    /* Can't queue the request, fail all pending blocks */
+    errlogPrintf("devXiDnAsyn: ASYN Send for PLC \"%s\" failed\n",
+		 psched->plcInfo->name);
+    psched->reading = psched->pending;
+    psched->pending = NULL;
+    epicsMutexUnlock(psched->mutex);
+    
+    psched->msg.status = DN_INTERNAL;
+    devXiDnCallback(&psched->msg);
+}
+
+static void rd_window(CALLBACK *pcb) {
+    struct rdSched *psched;
+    
+    callbackGetUser(psched, pcb);
+    rd_next(psched);
+}
+
+static int rd_request(struct rdItem *pitem, int prio) {
+    struct rdSched *psched = pitem->sched;
+    struct plcInfo *pPlc = psched->plcInfo;
+    struct rdItem **ppitem;
+    int raise = FALSE;
+    int status = 0;
+    
+    epicsMutexMustLock(psched->mutex);
+    if (pitem->active) {
+	/* Already pending or being read, may need to hurry it along */
+	if (prio > pitem->prio) {
+	    pitem->prio = prio;
+	    if (psched->active && prio > psched->msg.priority) {
+		psched->msg.priority = prio;
+		raise = TRUE;
+	    }
 	}
+	epicsMutexUnlock(psched->mutex);
+	/* Re-queuing waits for our callback, which takes the mutex */
+	if (raise)
+	    dnAsynClientPriority(&psched->msg, prio);
+	return 0;
     }
-    /* Update timestamp even on error so I/O Intr records don't retry I/O */
-    epicsTimeGetCurrent(&pitem->timestamp);
-    epicsMutexUnlock(pitem->cacheMutex);
-    pitem->active = FALSE;
-    epicsMutexUnlock(pitem->msgMutex);
     
-    /* Now process all the waiting records */
-    while (dpvt != NULL) {
-	struct dbCommon *prec = dpvt->precord;
-	rset *prset = prec->rset;
-	if (devDnAsynDebug >= 15) {
-	    printf("Examining \"%s\", waiting = %d\n", prec->name, dpvt->waiting);
+    ppitem = &psched->pending;
+    while (*ppitem && (*ppitem)->startAddr < pitem->startAddr)
+	ppitem = &(*ppitem)->schedNext;
+    pitem->schedNext = *ppitem;
+    *ppitem = pitem;
+    pitem->active = TRUE;
+    pitem->prio = prio;
+    
+    if (psched->active) {
+	/* Already queued, make sure it goes soon enough for this one */
+	if (prio > psched->msg.priority) {
+	    psched->msg.priority = prio;
+	    raise = TRUE;
 	}
-	if (dpvt->waiting) {
-	    dbScanLock(dpvt->precord);
-	    (*prset->process)(dpvt->precord);
-	    dbScanUnlock(dpvt->precord);
+    } else {
+	psched->active = TRUE;
+	psched->msg.priority = prio;
+	if (pPlc->rdWindow > 0) {
+	    callbackRequestDelayed(&psched->window, pPlc->rdWindow);
+	} else {
+	    status = dnAsynClientSend(&psched->msg);
+	    if (status) {
+		/* Nothing else can be pending */
+		psched->pending = NULL;
+		psched->active = FALSE;
+		pitem->active = FALSE;
+	    }
 	}
-	dpvt = dpvt->recNext;
     }
+    epicsMutexUnlock(psched->mutex);
     
-    /* Finally trigger any I/O Interrupt records */
-    scanIoRequest(pitem->intInfo);
+    if (raise)
+	dnAsynClientPriority(&psched->msg, prio);
+    return status;
 }
 
-
-static long init_input(struct dbCommon *prec, enum recType type, struct link *plink) {
-    struct dpvtIn *dpvt;
-    struct rdCache **ppcache, *pcache;
+static struct rdSched * new_rdsched(struct plcInfo *pPlc) {
+    struct rdSched *psched;
+    struct plcMessage *pMsg;
+    
+    psched = (struct rdSched *) calloc(1, sizeof(struct rdSched));
+    if (psched == NULL) {
+	errlogPrintf("devXiDnAsyn: calloc failed for PLC \"%s\"\n",
+		     pPlc->name);
+	return NULL;
+    }
+    psched->plcInfo = pPlc;
+    psched->mutex = epicsMutexMustCreate();
+    callbackSetCallback(rd_window, &psched->window);
+    callbackSetPriority(priorityHigh, &psched->window);
+    callbackSetUser(psched, &psched->window);
+    
+    /* plcMessage entry */
+    pMsg = &psched->msg;
+    pMsg->port     = pPlc->port;
+    pMsg->proto    = pPlc->proto;
+    pMsg->link     = &pPlc->link;
+    pMsg->cmd      = (pPlc->slaveId << 8) | READVMEM;
+    pMsg->pdata    = psched->msgData;
+    pMsg->prepare  = devXiDnPrepare;
+    pMsg->more     = devXiDnMore;
+    pMsg->callback = devXiDnCallback;
+    if (!pPlc->connflag) {
+	pMsg->connstat = devXiDnConnstat;
+	pPlc->connflag = TRUE;
+    }
+    
+    /* creat a new ASYN client object */
+    if (initDnAsynClient(pMsg)) {
+	free(psched);
+	return NULL;
+    }
+    
+    pPlc->rdSched = psched;
+    return psched;
+}
+
+
+/* Background polling
+ *
+ * createDnAsynPoller() gives a polling period for some or all of a PLC's
+ * read blocks. One thread per asyn port requests reads of its polled
+ * blocks through the PLCs' read schedulers when they become due; the
+ * completed reads trigger the blocks' I/O Intr records as usual. A block
+ * that was read recently for some other reason won't be polled again
+ * until a full period has passed since that read.
+ */
+
+struct pollReq {
+    struct pollReq *pNext;
     struct plcInfo *pPlc;
-    unsigned int addr;
-    long status;
-    const int numWords = (type == AIF) ? 2 : 1;
-    const int maxWords = DN_RDDATA_MAX / DN_PLCWORDLEN;
+    double period;
+    unsigned int addr;		/* Zero means all blocks */
+};
+
+static struct pollReq *pollReqs;
+static int planned;		/* Set once read blocks exist */
+
+static void poll_thread(void *arg) {
+    struct dnPoller *ppoll = (struct dnPoller *) arg;
     
-    if (devDnAsynDebug > 0)
-	printf ("devXiDnAsyn: init_input invoked for \"%s\"\n", prec->name);
+    for (;;) {
+	struct rdItem *pitem;
+	epicsTimeStamp tNow;
+	double wait = 10.0;
+	
+	epicsTimeGetCurrent(&tNow);
+	epicsMutexMustLock(ppoll->mutex);
+	for (pitem = ppoll->items; pitem; pitem = pitem->pollNext) {
+	    double due;
+	    
+	    if (pitem->pollPeriod <= 0)
+		continue;
+	    
+	    due = epicsTimeDiffInSeconds(&pitem->pollDue, &tNow);
+	    if (due <= 0) {
+		struct rdValue val;
+		
+		rd_snapshot(pitem, 0, 0, &val);
+		if (epicsTimeDiffInSeconds(&tNow, &val.timestamp) < pitem->pollPeriod) {
+		    /* Read recently, wait a full period from then */
+		    pitem->pollDue = val.timestamp;
+		} else {
+		    struct plcInfo *pPlc = pitem->sched->plcInfo;
+		    int prio = (pPlc->rdPriority == DN_PRIO_AUTO) ?
+			DN_PRIO_LOW : pPlc->rdPriority;
+		    
+		    if (rd_request(pitem, prio)) {
+			errlogPrintf("devXiDnAsyn: Poll of V%o on port \"%s\" failed\n",
+				     pitem->startAddr - DNREFOFFSET, ppoll->port);
+			pitem->sched->plcInfo->nAsynFail++;
+		    }
+		    ppoll->nPolls++;
+		    pitem->pollDue = tNow;
+		}
+		epicsTimeAddSeconds(&pitem->pollDue, pitem->pollPeriod);
+		due = epicsTimeDiffInSeconds(&pitem->pollDue, &tNow);
+	    }
+	    if (due < wait)
+		wait = due;
+	}
+	epicsMutexUnlock(ppoll->mutex);
+	
+	epicsEventWaitWithTimeout(ppoll->wakeup, wait);
+    }
+}
+
+static struct dnPoller * find_poller(const char *port) {
+    struct dnPoller *ppoll;
+    char name[32];
     
-    dpvt = (struct dpvtIn *) calloc(1, sizeof(struct dpvtIn));
-    if (dpvt == NULL) {
-	errlogPrintf("devXiDnAsyn: calloc failed for \"%s\"\n", prec->name);
-	prec->pact = TRUE;
-	return S_rec_outMem;
+    for (ppoll = pollers; ppoll; ppoll = ppoll->pNext) {
+	if (strcmp(port, ppoll->port) == 0)
+	    return ppoll;
     }
-    prec->dpvt = (void *) dpvt;
     
-    dpvt->precord = prec;
-    dpvt->type    = type;
-    dpvt->waiting = FALSE;
+    ppoll = (struct dnPoller *) calloc(1, sizeof(struct dnPoller));
+    if (ppoll == NULL) {
+	errlogPrintf("devXiDnAsyn: calloc failed for poller on port \"%s\"\n",
+		     port);
+	return NULL;
+    }
+    ppoll->port = port;
+    ppoll->mutex = epicsMutexMustCreate();
+    ppoll->wakeup = epicsEventMustCreate(epicsEventEmpty);
     
-    status = dnAsynAddr(prec, &dpvt->plcAddr, plink);
-    if (status) {
-	prec->pact = TRUE;
-	return status;
+    epicsSnprintf(name, sizeof(name), "dnPoll-%s", port);
+    if (!epicsThreadCreate(name, epicsThreadPriorityMedium,
+	    epicsThreadGetStackSize(epicsThreadStackSmall),
+	    poll_thread, ppoll)) {
+	errlogPrintf("devXiDnAsyn: Can't create poller thread for port \"%s\"\n",
+		     port);
+	free(ppoll);
+	return NULL;
     }
-    pPlc = dpvt->plcAddr.plcInfo;
-    addr = dpvt->plcAddr.vAddr;
     
-    dpvt->plcInfo = pPlc;
+    ppoll->pNext = pollers;
+    pollers = ppoll;
+    return ppoll;
+}
+
+/* Find the block holding a V-memory address */
+
+static int cmpItemAddr(const void *pkey, const void *pelem) {
+    unsigned int addr = *(const unsigned int *) pkey;
+    const struct rdItem *pitem = *(const struct rdItem * const *) pelem;
     
-    if (devDnAsynDebug > 10)
-	printf ("devXiDnAsyn: dpvt = %p, vAddr = V%o\n", 
-		dpvt, addr - DNREFOFFSET);
-
-    /* Search for an existing cache entry or one that can be extended */
-    ppcache = &(pPlc->rdCache);
-    while ((pcache = *ppcache)) {
-	if ((addr >= pcache->item.startAddr + pcache->item.nWords - maxWords) &&
-	    (addr + numWords <= pcache->item.startAddr + maxWords)) {
-	    if (devDnAsynDebug > 10)
-		printf ("devXiDnAsyn: Suitable rdCache entry found: V%o\n", 
-			pcache->item.startAddr - DNREFOFFSET);
-	    break;
-	}
-	ppcache = &pcache->pNext;
+    if (addr < pitem->startAddr)
+	return -1;
+    return addr >= pitem->startAddr + pitem->nWords;
+}
+
+static struct rdItem * find_item(struct plcInfo *pPlc, unsigned int addr) {
+    struct rdSched *psched = pPlc->rdSched;
+    struct rdItem **ppitem;
+    
+    if (!psched || !psched->nIndex)
+	return NULL;
+    ppitem = (struct rdItem **) bsearch(&addr, psched->index,
+	psched->nIndex, sizeof(struct rdItem *), cmpItemAddr);
+    return ppitem ? *ppitem : NULL;
+}
+
+/* Caller must hold ppoll->mutex */
+static void poll_item(struct dnPoller *ppoll, struct rdItem *pitem,
+    double period) {
+    if (!pitem->polled) {
+	pitem->pollNext = ppoll->items;
+	ppoll->items = pitem;
+	pitem->polled = TRUE;
     }
+    pitem->pollPeriod = period;
+    epicsTimeGetCurrent(&pitem->pollDue);
+}
+
+static void poll_apply(struct pollReq *preq) {
+    struct plcInfo *pPlc = preq->pPlc;
+    struct dnPoller *ppoll;
+    struct rdCache *pcache;
+    int found = 0;
+    
+    ppoll = find_poller(pPlc->port);
+    if (ppoll == NULL)
+	return;
     
-    if (pcache == NULL) {
-	struct plcMessage *pMsg;
+    epicsMutexMustLock(ppoll->mutex);
+    if (preq->addr) {
+	struct rdItem *pitem = find_item(pPlc, preq->addr);
 	
-	/* Not found, create a new entry */
-	pcache = (struct rdCache *) calloc(1, sizeof (struct rdCache));
-	if (pcache == NULL) {
-	    errlogPrintf("devXiDnAsyn: calloc failed for \"%s\"\n", prec->name);
-	    prec->pact = TRUE;
-	    return S_rec_outMem;
-	    /* Really ought to free dpvt first... */
+	if (pitem) {
+	    poll_item(ppoll, pitem, preq->period);
+	    found++;
 	}
+    } else {
+	for (pcache = pPlc->rdCache; pcache; pcache = pcache->pNext) {
+	    poll_item(ppoll, &pcache->item, preq->period);
+	    found++;
+	}
+    }
+    epicsMutexUnlock(ppoll->mutex);
+    epicsEventSignal(ppoll->wakeup);
+    
+    if (!found)
+	errlogPrintf("devXiDnAsyn: No read block holds V%o on PLC \"%s\"\n",
+		     preq->addr - DNREFOFFSET, pPlc->name);
+}
+
+static void poll_start(void) {
+    struct pollReq *preq = pollReqs;
+    
+    pollReqs = NULL;
+    while (preq) {
+	struct pollReq *pnext = preq->pNext;
 	
-	if (devDnAsynDebug > 10)
-	    printf ("devXiDnAsyn: new rdCache entry created for V%o\n", 
-		    addr - DNREFOFFSET);
-	
-	/* Initialise: cache entry */
-	pcache->item.startAddr = addr;
-	pcache->item.nWords = numWords;
-	pcache->item.active = FALSE;
-	pcache->item.msgMutex = epicsMutexMustCreate();
-	pcache->item.cacheMutex = epicsMutexMustCreate();
-	pcache->item.timestamp.secPastEpoch = 0;
-	scanIoInit(&pcache->item.intInfo);
+	poll_apply(preq);
+	free(preq);
+	preq = pnext;
+    }
+}
+
+int createDnAsynPoller(const char *pname, double period, const char *addr) {
+    struct pollReq *preq, **ppreq;
+    struct plcInfo *pPlc;
+    unsigned int vAddr = 0;
+    
+    if (!pname) {
+	printf("Usage: createDnAsynPoller \"PLC name\", period, \"V-address\"\n");
+	return -1;
+    }
+    pPlc = dnAsynPlc(pname);
+    if (pPlc == NULL) {
+	printf("createDnAsynPoller: No PLC named \"%s\"\n", pname);
+	return -1;
+    }
+    if (addr && *addr) {
+	char *end;
 	
-	/* plcMessage entry */
-	pMsg = &pcache->item.msg;
-	pMsg->port     = pPlc->port;
-	pMsg->proto    = pPlc->proto;
-	pMsg->cmd      = (pPlc->slaveId << 8) | READVMEM;
-	pMsg->len      = PLCWORDBYTES * numWords;
-	pMsg->addr     = addr;
-	pMsg->pdata    = pcache->item.msgData;
-	pMsg->callback = devXiDnCallback;
-	if (!pPlc->connflag) {
-	    pMsg->connstat = devXiDnConnstat;
-	    pPlc->connflag = TRUE;
+	if (*addr == 'V')
+	    addr++;
+	vAddr = strtoul(addr, &end, 8);
+	if (end == addr || *end) {
+	    printf("createDnAsynPoller: Bad V-memory address \"%s\"\n", addr);
+	    return -1;
 	}
+	vAddr += DNREFOFFSET;
+    }
+    
+    preq = (struct pollReq *) calloc(1, sizeof(struct pollReq));
+    if (preq == NULL) {
+	perror("createDnAsynPoller");
+	return -1;
+    }
+    preq->pPlc = pPlc;
+    preq->period = period > 0 ? period : 0;
+    preq->addr = vAddr;
+    
+    if (planned) {
+	poll_apply(preq);
+	free(preq);
+    } else {
+	/* Apply after the read blocks are planned, in order given */
+	for (ppreq = &pollReqs; *ppreq; ppreq = &(*ppreq)->pNext);
+	*ppreq = preq;
+    }
+    return 0;
+}
+
+
+/* Read block planning
+ *
+ * init_input() only parses the record's address and queues it on the
+ * unplanned list; the read blocks are planned once all the records have
+ * been initialized, when the input device support init(after) routines
+ * get called. For each PLC the requested addresses are sorted and then
+ * partitioned into the set of disjoint blocks no larger than rdMax which
+ * has the lowest total cost, where each transaction costs xactCost bytes of
+ * link time plus the bytes read, including any unused words in the gaps.
+ */
+
+static struct dpvtIn *unplanned;
+
+#define dpvtWords(dpvt) (((dpvt)->type == AIF) ? 2 : 1)
+
+static int cmpDpvt(const void *pa, const void *pb) {
+    const struct dpvtIn *a = *(const struct dpvtIn * const *) pa;
+    const struct dpvtIn *b = *(const struct dpvtIn * const *) pb;
+    
+    if (a->plcInfo != b->plcInfo)
+	return strcmp(a->plcInfo->name, b->plcInfo->name);
+    return (int) a->plcAddr.vAddr - (int) b->plcAddr.vAddr;
+}
+
+static struct rdCache * new_rdcache(struct plcInfo *pPlc,
+    unsigned int addr, int nWords) {
+    struct rdCache *pcache;
+    
+    pcache = (struct rdCache *) calloc(1, sizeof (struct rdCache));
+    if (pcache)
+	pcache->item.snap[0].data = (unsigned short *)
+	    calloc(2 * nWords, sizeof(unsigned short));
+    if (pcache == NULL || !pcache->item.snap[0].data) {
+	errlogPrintf("devXiDnAsyn: calloc failed for PLC \"%s\"\n",
+		     pPlc->name);
+	free(pcache);
+	return NULL;
+    }
+    
+    if (devDnAsynDebug > 10)
+	printf ("devXiDnAsyn: new rdCache entry created for V%o - V%o\n", 
+		addr - DNREFOFFSET, addr + nWords - 1 - DNREFOFFSET);
+    
+    /* Initialise: cache entry */
+    pcache->item.sched = pPlc->rdSched;
+    pcache->item.startAddr = addr;
+    pcache->item.nWords = nWords;
+    pcache->item.active = FALSE;
+    pcache->item.snap[1].data = pcache->item.snap[0].data + nWords;
+    pcache->item.seq = 0;
+    pcache->item.snap[0].timestamp.secPastEpoch = 0;
+    pcache->item.snap[0].alarm = NO_ALARM;
+    scanIoInit(&pcache->item.intInfo);
+    
+    return pcache;
+}
+
+/* Index the PLC's blocks by address for find_item() */
+
+static void index_plc(struct plcInfo *pPlc) {
+    struct rdSched *psched = pPlc->rdSched;
+    struct rdCache *pcache;
+    struct rdItem **index;
+    int n = 0;
+    
+    for (pcache = pPlc->rdCache; pcache; pcache = pcache->pNext)
+	n++;
+    index = (struct rdItem **) calloc(n ? n : 1, sizeof(struct rdItem *));
+    if (index == NULL) {
+	errlogPrintf("devXiDnAsyn: calloc failed indexing PLC \"%s\"\n",
+		     pPlc->name);
+	return;
+    }
+    n = 0;
+    for (pcache = pPlc->rdCache; pcache; pcache = pcache->pNext) {
+	/* bsearch() needs the blocks sorted and disjoint */
+	assert(n == 0 || index[n - 1]->startAddr + index[n - 1]->nWords <=
+	       pcache->item.startAddr);
+	index[n++] = &pcache->item;
+    }
+    free(psched->index);
+    psched->index = index;
+    psched->nIndex = n;
+}
+
+static void plan_plc(struct plcInfo *pPlc, struct dpvtIn **recs, int nRecs) {
+    const int maxWords = pPlc->rdMax / DN_PLCWORDLEN;
+    const int limitWords = DN_RDDATA_LIMIT / DN_PLCWORDLEN;
+    struct span {
+	unsigned int start, end;	/* end is exclusive */
+	struct rdCache *pcache;
+    } *units;
+    struct rdCache **ppcache;
+    double *cost;
+    int *first, *unitOf;
+    int nUnits = 0;
+    int i, j;
+    
+    units  = (struct span *) calloc(nRecs, sizeof(struct span));
+    unitOf = (int *) calloc(nRecs, sizeof(int));
+    first  = (int *) calloc(nRecs, sizeof(int));
+    cost   = (double *) calloc(nRecs + 1, sizeof(double));
+    if (!pPlc->rdSched)
+	new_rdsched(pPlc);
+    if (!units || !unitOf || !first || !cost || !pPlc->rdSched) {
+	errlogPrintf("devXiDnAsyn: calloc failed planning PLC \"%s\"\n",
+		     pPlc->name);
+	for (i = 0; i < nRecs; i++)
+	    recs[i]->precord->pact = TRUE;
+	goto done;
+    }
+    
+    /* Merge records that share words into indivisible units. A chain of
+     * overlapping records can make a unit wider than rdMax; it then gets
+     * a block to itself, since splitting it would make blocks overlap. */
+    for (i = 0; i < nRecs; i++) {
+	unsigned int start = recs[i]->plcAddr.vAddr;
+	unsigned int end = start + dpvtWords(recs[i]);
+	struct span *pu = nUnits ? &units[nUnits - 1] : NULL;
 	
-	/* creat a new ASYN client object */
-	status = initDnAsynClient(pMsg);
-	if (status) {
-	    prec->pact = TRUE;
-	    return status;
+	if (pu && start < pu->end) {
+	    if (end > pu->end)
+		pu->end = end;
+	} else {
+	    pu = &units[nUnits++];
+	    pu->start = start;
+	    pu->end = end;
 	}
+	unitOf[i] = nUnits - 1;
+    }
+    
+    /* cost[j] is the cheapest way to read units 0 .. j-1 and
+     * first[j-1] the first unit in the last block of that solution */
+    cost[0] = 0;
+    for (j = 0; j < nUnits; j++) {
+	unsigned int end = units[j].end;
 	
-	/* Finally install the various list links */
-	dpvt->recNext = NULL;
-	pcache->pNext = NULL;
-	pcache->item.recList = dpvt;
-	(*ppcache) = pcache;
-	
-    } else if (addr < pcache->item.startAddr) {
-	/* Need to extend the existing entry backwards */
-	if (devDnAsynDebug > 10)
-	    printf ("devXiDnAsyn: Extending entry back to V%o\n", 
-		    addr - DNREFOFFSET);
-	
-	/* Adjust entry start address and length */
-	pcache->item.nWords += pcache->item.startAddr - addr;
-	pcache->item.startAddr = addr;
-	
-	/* Repeat that change in the plcMessage */
-	pcache->item.msg.addr = dpvt->plcAddr.vAddr;
-	pcache->item.msg.len  = pcache->item.nWords * PLCWORDBYTES;
-	
-	/* Finally insert this record in item's record list */
-	dpvt->recNext = pcache->item.recList;
-	pcache->item.recList = dpvt;
+	cost[j + 1] = -1;
+	for (i = j; i >= 0; i--) {
+	    double total;
+	    
+	    if (units[i].end > end)
+		end = units[i].end;
+	    if (i < j && end - units[i].start > maxWords)
+		break;
+	    total = cost[i] + pPlc->xactCost +
+		(end - units[i].start) * DN_PLCWORDLEN;
+	    if (cost[j + 1] < 0 || total < cost[j + 1]) {
+		cost[j + 1] = total;
+		first[j] = i;
+	    }
+	}
+    }
+    
+    /* Create the blocks, walking backwards through the solution */
+    for (j = nUnits - 1; j >= 0; j = i - 1) {
+	struct rdCache *pcache;
+	unsigned int end = 0;
+	int k;
 	
-    } else if (addr + numWords > pcache->item.startAddr + pcache->item.nWords) {
-	/* Need to extend the existing entry forwards */
-	if (devDnAsynDebug > 10)
-	    printf ("devXiDnAsyn: Extending entry forward to V%o\n", 
-		    addr + numWords - 1 - DNREFOFFSET);
+	i = first[j];
+	for (k = i; k <= j; k++)
+	    if (units[k].end > end)
+		end = units[k].end;
 	
-	/* Adjust entry length, in message too */
-	pcache->item.nWords  = addr + numWords - pcache->item.startAddr;
-	pcache->item.msg.len = pcache->item.nWords * PLCWORDBYTES;
+	if (end - units[i].start > limitWords) {
+	    errlogPrintf("devXiDnAsyn: PLC \"%s\" has overlapping input "
+			 "records V%o - V%o, too many to read at once\n",
+			 pPlc->name, units[i].start - DNREFOFFSET,
+			 end - 1 - DNREFOFFSET);
+	    pcache = NULL;
+	} else {
+	    pcache = new_rdcache(pPlc, units[i].start, end - units[i].start);
+	}
+	for (k = i; k <= j; k++)
+	    units[k].pcache = pcache;
+    }
+    
+    if (devDnAsynDebug > 0)
+	printf("devXiDnAsyn: PLC \"%s\" has %d input records in %d units, "
+	       "planned read cost %g bytes\n",
+	       pPlc->name, nRecs, nUnits, cost[nUnits]);
+    
+    /* Attach the records to their blocks */
+    for (i = 0; i < nRecs; i++) {
+	struct dpvtIn *dpvt = recs[i];
+	struct rdCache *pcache = units[unitOf[i]].pcache;
 	
-	/* Finally insert this record in item's record list */
+	if (pcache == NULL) {
+	    dpvt->precord->pact = TRUE;
+	    continue;
+	}
 	dpvt->recNext = pcache->item.recList;
 	pcache->item.recList = dpvt;
+	dpvt->rdItem = &pcache->item;
+    }
+    
+    /* Finally append the blocks to the PLC's list in address order */
+    ppcache = &pPlc->rdCache;
+    while (*ppcache)
+	ppcache = &(*ppcache)->pNext;
+    for (i = 0; i < nUnits; i++) {
+	struct rdCache *pcache = units[i].pcache;
 	
-    } else {
-	if (devDnAsynDebug > 10)
-	    printf ("devXiDnAsyn: No change needed for V%o\n", 
-		    addr - DNREFOFFSET);
-	
-	/* Just need to insert this record in item's record list */
-	dpvt->recNext = pcache->item.recList;
-	pcache->item.recList = dpvt;
+	if (pcache && (i == 0 || pcache != units[i - 1].pcache)) {
+	    *ppcache = pcache;
+	    ppcache = &pcache->pNext;
+	}
+    }
+    index_plc(pPlc);
+    
+done:
+    free(units);
+    free(unitOf);
+    free(first);
+    free(cost);
+}
+
+static void plan_reads(void) {
+    struct dpvtIn **recs, *dpvt;
+    int nRecs = 0;
+    int i, j;
+    
+    if (planned)
+	return;
+    planned = TRUE;
+    
+    for (dpvt = unplanned; dpvt; dpvt = dpvt->recNext)
+	nRecs++;
+    if (nRecs == 0)
+	return;
+    
+    recs = (struct dpvtIn **) calloc(nRecs, sizeof(struct dpvtIn *));
+    if (recs == NULL) {
+	errlogPrintf("devXiDnAsyn: calloc failed planning read blocks\n");
+	for (dpvt = unplanned; dpvt; dpvt = dpvt->recNext)
+	    dpvt->precord->pact = TRUE;
+	return;
     }
+    for (i = 0, dpvt = unplanned; dpvt; dpvt = dpvt->recNext)
+	recs[i++] = dpvt;
+    unplanned = NULL;
     
-    /* Make sure we can get to the cache line from the record */
-    dpvt->rdItem = &pcache->item;
+    qsort(recs, nRecs, sizeof(struct dpvtIn *), cmpDpvt);
+    
+    /* Plan each PLC's records separately */
+    for (i = 0; i < nRecs; i = j) {
+	for (j = i + 1; j < nRecs; j++)
+	    if (recs[j]->plcInfo != recs[i]->plcInfo)
+		break;
+	plan_plc(recs[i]->plcInfo, &recs[i], j - i);
+    }
+    free(recs);
+}
+
+static long init(int after) {
+    if (after) {
+	plan_reads();
+	poll_start();
+    }
     return 0;
 }
 
-
+
+static long init_input(struct dbCommon *prec, enum recType type, struct link *plink) {
+    struct dpvtIn *dpvt;
+    long status;
+    
+    if (devDnAsynDebug > 0)
+	printf ("devXiDnAsyn: init_input invoked for \"%s\"\n", prec->name);
+    
+    dpvt = (struct dpvtIn *) calloc(1, sizeof(struct dpvtIn));
+    if (dpvt == NULL) {
+	errlogPrintf("devXiDnAsyn: calloc failed for \"%s\"\n", prec->name);
+	prec->pact = TRUE;
+	return S_rec_outMem;
+    }
+    prec->dpvt = (void *) dpvt;
+    
+    dpvt->precord = prec;
+    dpvt->type    = type;
+    dpvt->waiting = RD_IDLE;
+    
+    status = dnAsynAddr(prec, &dpvt->plcAddr, plink);
+    if (status) {
+	prec->pact = TRUE;
+	return status;
+    }
+    dpvt->plcInfo = dpvt->plcAddr.plcInfo;
+    
+    if (devDnAsynDebug > 10)
+	printf ("devXiDnAsyn: dpvt = %p, vAddr = V%o\n", 
+		dpvt, dpvt->plcAddr.vAddr - DNREFOFFSET);
+    
+    /* The read block gets chosen later by plan_reads() */
+    dpvt->rdItem = NULL;
+    dpvt->recNext = unplanned;
+    unplanned = dpvt;
+    return 0;
+}
+
+
 static long init_ai(struct dbCommon *precord) {
     struct aiRecord *prec = (struct aiRecord *) precord;
     long status;
@@ -476,30 +1280,30 @@ static long get_ioint(int cmd, struct dbCommon *prec, IOSCANPVT *ppvt) {
     if (devDnAsynDebug >= 35)
 	printf ("devXiDnAsyn: get_ioint called for \"%s\"\n", prec->name);
     
+    if (!pitem) return S_dev_NoInit;
     *ppvt = pitem->intInfo;
     return 0;
 }
 
 
 
-static void get_data(struct dbCommon *prec) {
+static void get_data(struct dbCommon *prec, const struct rdValue *pval) {
     struct dpvtIn *dpvt=(struct dpvtIn *)prec->dpvt;
-    struct rdItem *pitem = dpvt->rdItem;
     unsigned long value;
     
     if (devDnAsynDebug >= 35)
 	printf ("devXiDnAsyn: get_data called for \"%s\"\n", prec->name);
     
     /* Deal with alarms first */
-    if (dpvt->plcInfo->alarm) {
+    if (pval->alarm) {
 	if (devDnAsynDebug >= 35)
-	    printf ("devXiDnAsyn: alarm status %d\n", dpvt->plcInfo->alarm);
-	recGblSetSevr(prec, READ_ALARM, dpvt->plcInfo->alarm);
+	    printf ("devXiDnAsyn: alarm status %d\n", pval->alarm);
+	recGblSetSevr(prec, READ_ALARM, pval->alarm);
 	return;
     }
     
     /* Find our particular number */
-    value = pitem->data[dpvt->plcAddr.vAddr - pitem->startAddr];
+    value = pval->data[0];
 
     if (devDnAsynDebug >= 35)
 	printf ("devXiDnAsyn: Raw value = %#lx\n", value);
@@ -522,7 +1326,7 @@ static void get_data(struct dbCommon *prec) {
 		    unsigned long l;
 		    float f;
 		} convert;
-		convert.l = pitem->data[dpvt->plcAddr.vAddr+1 - pitem->startAddr] << 16;
+		convert.l = pval->data[1] << 16;
 		convert.l |= value;
 		ai->val = convert.f;
 		ai->udf = isnan(ai->val);
@@ -548,18 +1352,41 @@ static void get_data(struct dbCommon *prec) {
 }
 
 
+/* Reads for Passive records are wanted now, periodic scans and
+ * I/O Intr refreshes can wait */
+static int rd_priority(struct dpvtIn *dpvt) {
+    int prio = dpvt->plcAddr.priority;
+    
+    if (prio == DN_PRIO_AUTO)
+	prio = dpvt->plcInfo->rdPriority;
+    if (prio != DN_PRIO_AUTO)
+	return prio;
+    
+    switch (dpvt->precord->scan) {
+    case menuScanPassive:
+	return DN_PRIO_HIGH;
+    case menuScanEvent:
+	return DN_PRIO_MEDIUM;
+    default:
+	return DN_PRIO_LOW;
+    }
+}
+
 static long read_data(struct dbCommon *prec) {
     struct dpvtIn *dpvt = (struct dpvtIn *) prec->dpvt;
     struct rdItem *pitem;
     struct plcInfo *pPlc;
+    struct rdValue val;
 
     if (devDnAsynDebug >= 35)
        printf ("devXiDnAsyn: read_data called for \"%s\"\n", prec->name);
 
-    if (!dpvt) return S_dev_NoInit;
+    if (!dpvt || !dpvt->rdItem) return S_dev_NoInit;
     
     pitem = dpvt->rdItem;
     pPlc = dpvt->plcInfo;
+    rd_snapshot(pitem, dpvt->plcAddr.vAddr - pitem->startAddr,
+		dpvtWords(dpvt), &val);
     
     if (!prec->pact) {
 	/* This is a read request, check the cache */
@@ -573,7 +1400,8 @@ static long read_data(struct dbCommon *prec) {
 	    staleTime = 0.1;
 	    break;
 	case menuScanI_O_Intr:
-	    staleTime = 10.0;
+	    /* A poller keeps these up to date */
+	    staleTime = (pitem->pollPeriod > 0) ? -1 : 10.0;
 	    break;
 	default:
 	    staleTime = scanPeriod(prec->scan) / 2;
@@ -581,38 +1409,29 @@ static long read_data(struct dbCommon *prec) {
 	epicsTimeGetCurrent(&tNow);
 	
 	/* If the cached data is not stale ... */
-	epicsMutexMustLock(pitem->cacheMutex);
-	if (epicsTimeDiffInSeconds(&tNow, &pitem->timestamp) < staleTime) {
+	if ((staleTime < 0) ||
+	    (epicsTimeDiffInSeconds(&tNow, &val.timestamp) < staleTime)) {
 	    /* .. then we can use it */
 	    if (devDnAsynDebug >= 3)
 		printf("devXiDnAsyn: Using value from read cache\n");
 	    
-	    get_data(prec);
-	    epicsMutexUnlock(pitem->cacheMutex);
+	    get_data(prec, &val);
 	    return (dpvt->type == AIF) ? 2 : 0;
 	}
-	epicsMutexUnlock(pitem->cacheMutex);
 	/* Can't use cache data, must request a read */
 	
 	if (devDnAsynDebug >= 3)
 	    epicsTimeGetCurrent(&dpvt->start);
-	dpvt->waiting = TRUE;
+	rd_wait(pitem, dpvt);
 	
 	/* Send the request */
-	epicsMutexMustLock(pitem->msgMutex);
-	if (!pitem->active) {
-	    pitem->active = TRUE;
-	    if (dnAsynClientSend(&pitem->msg)) {
-		pitem->active = FALSE;
-		epicsMutexUnlock(pitem->msgMutex);
-		recGblSetSevr(prec, WRITE_ALARM, MAJOR_ALARM);
-		errlogPrintf("devXiDnAsyn: ASYN Send by \"%s\" failed\n", prec->name);
-		pPlc->nAsynFail++;
-		return -1;
-	    }
-	    pPlc->nRdReqs++;
+	if (rd_request(pitem, rd_priority(dpvt))) {
+	    epicsAtomicCmpAndSwapIntT(&dpvt->waiting, RD_WAITING, RD_DROPPED);
+	    recGblSetSevr(prec, WRITE_ALARM, MAJOR_ALARM);
+	    errlogPrintf("devXiDnAsyn: ASYN Send by \"%s\" failed\n", prec->name);
+	    pPlc->nAsynFail++;
+	    return -1;
 	}
-	epicsMutexUnlock(pitem->msgMutex);
 	
 	if (devDnAsynDebug >= 10)
 	    printf("devXiDnAsyn: Read requested at V%o\n", 
@@ -622,13 +1441,10 @@ static long read_data(struct dbCommon *prec) {
     } else {
 	/* An ASYN request has completed */
 	if (devDnAsynDebug >= 5)
-	    printf("devXiDnAsyn: alarm = %d\n", pPlc->alarm);
+	    printf("devXiDnAsyn: alarm = %d\n", val.alarm);
 	
-	epicsMutexMustLock(pitem->cacheMutex);
-	get_data(prec);
-	epicsMutexUnlock(pitem->cacheMutex);
+	get_data(prec, &val);
 	
-	dpvt->waiting = FALSE;
 	if (devDnAsynDebug >= 3) {
 	    epicsTimeStamp tNow;
 	    double duration;
@@ -646,23 +1462,23 @@ static long read_data(struct dbCommon *prec) {
 /* Device Support Entry Tables */
 
 XXDSET devAiDnAsyn = {
-    { 6, NULL, NULL, init_ai, get_ioint},
+    { 6, NULL, init, init_ai, get_ioint},
     read_data, NULL
 };
 XXDSET devAiFDnAsyn = {
-    { 6, NULL, NULL, init_aif, get_ioint},
+    { 6, NULL, init, init_aif, get_ioint},
     read_data, NULL
 };
 XXDSET devBiDnAsyn = {
-    { 5, report, NULL, init_bi, get_ioint},
+    { 5, report, init, init_bi, get_ioint},
     read_data
 };
 XXDSET devMbbiDnAsyn = {
-    { 5, NULL, NULL, init_mbbi, get_ioint},
+    { 5, NULL, init, init_mbbi, get_ioint},
     read_data
 };
 XXDSET devMbbidDnAsyn = {
-    { 5, NULL, NULL, init_mbbid, get_ioint},
+    { 5, NULL, init, init_mbbid, get_ioint},
     read_data
 };
 
@@ -671,3 +1487,25 @@ epicsExportAddress(dset, devAiFDnAsyn);
 epicsExportAddress(dset, devBiDnAsyn);
 epicsExportAddress(dset, devMbbiDnAsyn);
 epicsExportAddress(dset, devMbbidDnAsyn);
+
+
+/* Command registry data:
+ * 	createDnAsynPoller(const char* pname, double period, const char* addr)
+ */
+static const iocshArg cmd0Arg0 = { "PLC name",iocshArgString};
+static const iocshArg cmd0Arg1 = { "period",iocshArgDouble};
+static const iocshArg cmd0Arg2 = { "V-address",iocshArgString};
+static const iocshArg * const cmd0Args[] =
+    {&cmd0Arg0,&cmd0Arg1,&cmd0Arg2};
+static const iocshFuncDef cmd0FuncDef =
+    {"createDnAsynPoller", 3, cmd0Args};
+static void cmd0CallFunc(const iocshArgBuf *args)
+{
+    createDnAsynPoller(args[0].sval, args[1].dval, args[2].sval);
+}
+
+/* Registrar routine */
+void devXiDnAsynRegistrar(void) {
+    iocshRegister(&cmd0FuncDef, cmd0CallFunc);
+}
+epicsExportRegistrar(devXiDnAsynRegistrar);
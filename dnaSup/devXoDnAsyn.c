@@ -19,12 +19,15 @@ Version:
 /* OS */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libCom */
 #include <alarm.h>
+#include <epicsMutex.h>
 #include <errlog.h>
 
 /* IOC */
+#include <callback.h>
 #include <dbLock.h>
 #include <devSup.h>
 #include <drvSup.h>
@@ -45,24 +48,47 @@ Version:
 #include "directNetClient.h"
 
 
-struct wrCache {    /* wrCache is a simple array of all the writable memory */
+/* The wrCache holds an image of all the writable memory and combines
+ * writes to it. Records mark the words they change as dirty and put
+ * themselves on the pending list, and each time the cache's message gets
+ * to the front of the asyn queue its prepare routine sends the first run
+ * of contiguous dirty words as a single write. The records whose words
+ * were in that run all complete when it has been acknowledged. A word
+ * that is written again before it has been sent just gets its new value,
+ * so only the latest value goes to the PLC.
+ */
+struct wrCache {
+    struct plcMessage msg;	/* *MUST* be first, see devXoDnCallback */
+    struct plcInfo *plcInfo;
+    epicsMutexId mutex;		/* Protects everything below */
     struct wrItem {
 	unsigned short word;
+	unsigned char dirty;	/* Changed but not yet sent */
     } item[WRITEMAXADDR - WRITEMINADDR + 1];
-    epicsMutexId mutex;
+    struct dpvtOut *pending;	/* Records with data to be written */
+    struct dpvtOut *writing;	/* Records in the current transaction */
+    unsigned char active;	/* Message is queued or being processed */
+    CALLBACK window;		/* Delays the first request */
+    unsigned long nXacts;
+    unsigned long nMerged;
+    unsigned long nCoalesced;
+    char msgData[(WRITEMAXADDR - WRITEMINADDR + 1) * DN_PLCWORDLEN];
 };
 
 struct dpvtOut {
-    struct plcMessage msg;
-    char msgData[DN_PLCWORDLEN*2];
     struct dbCommon *precord;
     enum recType {AO, AOF, BO, MBBO, MBBOD} type;
     struct plcAddr plcAddr;
-    epicsMutexId mutex;
+    struct wrCache *wrCache;
     struct wrItem *wrItem;
+    unsigned short nWords;
+    struct dpvtOut *wrNext;	/* Protected by wrCache->mutex */
+    int status;			/* DirectNet status of last write */
     epicsTimeStamp start;
 };
 
+#define wrIndex(vAddr) ((vAddr) - (WRITEMINADDR + DNREFOFFSET))
+
 
 static void ioReport(int detail, struct plcInfo *pPlc) {
     struct wrCache *pcache = pPlc->wrCache;
@@ -72,6 +98,10 @@ static void ioReport(int detail, struct plcInfo *pPlc) {
 		WRITEMINADDR,
 		WRITEMAXADDR,
 		&(pcache->item[0].word));
+	if (detail == 2)
+	    printf("    WrCache made %lu transactions, %lu writes combined, "
+		   "%lu values replaced\n",
+		   pcache->nXacts, pcache->nMerged, pcache->nCoalesced);
     }
     return;
 }
@@ -81,14 +111,218 @@ static long report(int detail) {
     return 0;
 }
 
+static int devXoDnPrepare(struct plcMessage *pMsg) {
+    /* This uses a kludge, we actually need the address of the struct wrCache.
+     * The two must be identical or this will fail. */
+    struct wrCache *pcache = (struct wrCache *) pMsg;
+    struct plcInfo *pPlc = pcache->plcInfo;
+    const int nItems = WRITEMAXADDR - WRITEMINADDR + 1;
+    struct dpvtOut *dpvt, **pdpvt, **pwrite;
+    int first, last, i, n = 0;
+    
+    epicsMutexMustLock(pcache->mutex);
+    for (first = 0; first < nItems && !pcache->item[first].dirty; first++);
+    if (first == nItems) {
+	/* Nothing dirty, complete any records still pending */
+	pcache->writing = pcache->pending;
+	pcache->pending = NULL;
+	epicsMutexUnlock(pcache->mutex);
+	return -1;
+    }
+    for (last = first; last < nItems && pcache->item[last].dirty; last++) {
+	struct wrItem *pitem = &pcache->item[last];
+	char *pdata = &pcache->msgData[(last - first) * DN_PLCWORDLEN];
+	
+	pdata[0] = pitem->word & 0xff;
+	pdata[1] = (pitem->word >> 8) & 0xff;
+	pitem->dirty = FALSE;
+    }
+    
+    /* Move the records in this run to the writing list */
+    pdpvt = &pcache->pending;
+    pwrite = &pcache->writing;
+    while ((dpvt = *pdpvt)) {
+	i = wrIndex(dpvt->plcAddr.vAddr);
+	if (i >= first && i + dpvt->nWords <= last) {
+	    *pdpvt = dpvt->wrNext;
+	    dpvt->wrNext = NULL;
+	    *pwrite = dpvt;
+	    pwrite = &dpvt->wrNext;
+	    if (n++)
+		pcache->nMerged++;
+	} else
+	    pdpvt = &dpvt->wrNext;
+    }
+    pcache->nXacts++;
+    epicsMutexUnlock(pcache->mutex);
+    
+    pMsg->addr = first + WRITEMINADDR + DNREFOFFSET;
+    pMsg->len  = (last - first) * DN_PLCWORDLEN;
+    pPlc->nWrReqs++;
+    
+    if (devDnAsynDebug >= 10)
+	printf("devXoDnAsyn: Writing V%o - V%o to PLC \"%s\"\n",
+	       first + WRITEMINADDR, last - 1 + WRITEMINADDR, pPlc->name);
+    return 0;
+}
+
+/* Records still pending means wr_next will queue the message again */
+static int devXoDnMore(struct plcMessage *pMsg) {
+    struct wrCache *pcache = (struct wrCache *) pMsg;
+    int more;
+    
+    epicsMutexMustLock(pcache->mutex);
+    more = (pcache->pending != NULL);
+    epicsMutexUnlock(pcache->mutex);
+    return more;
+}
+
+static void wr_next(struct wrCache *pcache);
+
 static void devXoDnCallback(struct plcMessage *pMsg) {
-    struct dpvtOut  *dpvt = (struct dpvtOut *) pMsg;
-    struct dbCommon *precord=dpvt->precord;
-    rset *prset=precord->rset;
+    /* This uses a kludge, we actually need the address of the struct wrCache.
+     * The two must be identical or this will fail. */
+    struct wrCache *pcache = (struct wrCache *) pMsg;
+    struct plcInfo *pPlc = pcache->plcInfo;
+    struct dpvtOut *dpvt, *pnext;
+    
+    epicsMutexMustLock(pcache->mutex);
+    dpvt = pcache->writing;
+    pcache->writing = NULL;
+    if (dpvt == NULL && pMsg->status != DN_SUCCESS) {
+	/* The request timed out in the queue, fail all pending records */
+	dpvt = pcache->pending;
+	pcache->pending = NULL;
+    }
+    epicsMutexUnlock(pcache->mutex);
+    
+    if (pMsg->status == DN_SUCCESS) {
+	/* OK reply was received */
+	pPlc->alarm = NO_ALARM;
+	pPlc->nSuccess++;
+    } else if (pMsg->status == DN_PLC_DOWN) {
+	/* Failed at once, directNetClient logged the PLC going down */
+	pPlc->alarm = INVALID_ALARM;
+	pPlc->nDnFail++;
+    } else if (pMsg->status > DN_TIMEOUT) {
+	/* DirectNet I/O problem */
+	errlogPrintf("devXoDnAsyn: DirectNet error %s writing V%o[%d] to PLC \"%s\" on Asyn port \"%s\"\n",
+		     dn_error_strings[pMsg->status], pMsg->addr - DNREFOFFSET,
+		     pMsg->len, pPlc->name, pMsg->port);
+	pPlc->alarm = INVALID_ALARM;
+	pPlc->nDnFail++;
+    } else {
+	/* ASYN I/O problem */
+	errlogPrintf("devXoDnAsyn: dnAsyn error %s writing V%o[%d] to PLC \"%s\" on Asyn port \"%s\"\n",
+		     dn_error_strings[pMsg->status], pMsg->addr - DNREFOFFSET,
+		     pMsg->len, pPlc->name, pMsg->port);
+	pPlc->alarm = MAJOR_ALARM;
+	pPlc->nAsynFail++;
+    }
+    
+    /* Complete all the records that were written */
+    for (; dpvt; dpvt = pnext) {
+	struct dbCommon *precord = dpvt->precord;
+	rset *prset = precord->rset;
+	
+	pnext = dpvt->wrNext;
+	dpvt->status = pMsg->status;
+	dbScanLock(precord);
+	(*prset->process)(precord);
+	dbScanUnlock(precord);
+    }
+    
+    wr_next(pcache);
+}
+
+/* Records without a prio= link option use the PLC's wrPriority */
+static int wr_priority(struct dpvtOut *dpvt) {
+    return (dpvt->plcAddr.priority == DN_PRIO_AUTO) ?
+	dpvt->plcAddr.plcInfo->wrPriority : dpvt->plcAddr.priority;
+}
+
+/* Forget the words of records whose write is being failed, so they don't
+ * get sent later with some other record's. Caller must hold the mutex. */
+static void wr_discard(struct dpvtOut *dpvt) {
+    int i;
+    
+    for (; dpvt; dpvt = dpvt->wrNext)
+	for (i = 0; i < dpvt->nWords; i++)
+	    dpvt->wrItem[i].dirty = FALSE;
+}
+
+static void wr_next(struct wrCache *pcache) {
+    struct dpvtOut *dpvt;
+    
+    epicsMutexMustLock(pcache->mutex);
+    if (pcache->pending == NULL) {
+	pcache->active = FALSE;
+	epicsMutexUnlock(pcache->mutex);
+	return;
+    }
+    pcache->msg.priority = DN_PRIO_LOW;
+    for (dpvt = pcache->pending; dpvt; dpvt = dpvt->wrNext) {
+	if (wr_priority(dpvt) > pcache->msg.priority)
+	    pcache->msg.priority = wr_priority(dpvt);
+    }
+    if (dnAsynClientSend(&pcache->msg) == 0) {
+	epicsMutexUnlock(pcache->mutex);
+	return;
+    }
+    
+    /* Can't queue the request, fail all pending records */
+    errlogPrintf("devXoDnAsyn: ASYN Send for PLC \"%s\" failed\n",
+		 pcache->plcInfo->name);
+    wr_discard(pcache->pending);
+    pcache->writing = pcache->pending;
+    pcache->pending = NULL;
+    epicsMutexUnlock(pcache->mutex);
+    
+    pcache->msg.status = DN_INTERNAL;
+    devXoDnCallback(&pcache->msg);
+}
+
+static void wr_window(CALLBACK *pcb) {
+    struct wrCache *pcache;
+    
+    callbackGetUser(pcache, pcb);
+    wr_next(pcache);
+}
 
-    dbScanLock(precord);
-    (*prset->process)(precord);
-    dbScanUnlock(precord);
+static struct wrCache * new_wrcache(struct plcInfo *pPlc) {
+    struct wrCache *pcache;
+    struct plcMessage *pMsg;
+    
+    pcache = (struct wrCache *) calloc(1, sizeof (struct wrCache));
+    if (pcache == NULL) {
+	errlogPrintf("devXoDnAsyn: calloc failed for PLC \"%s\"\n",
+		     pPlc->name);
+	return NULL;
+    }
+    pcache->plcInfo = pPlc;
+    pcache->mutex = epicsMutexMustCreate();
+    callbackSetCallback(wr_window, &pcache->window);
+    callbackSetPriority(priorityHigh, &pcache->window);
+    callbackSetUser(pcache, &pcache->window);
+    
+    /* plcMessage entry */
+    pMsg = &pcache->msg;
+    pMsg->port     = pPlc->port;
+    pMsg->proto    = pPlc->proto;
+    pMsg->link     = &pPlc->link;
+    pMsg->prepare  = devXoDnPrepare;
+    pMsg->more     = devXoDnMore;
+    pMsg->callback = devXoDnCallback;
+    pMsg->cmd      = (pPlc->slaveId << 8) | WRITEVMEM;
+    pMsg->pdata    = pcache->msgData;
+    
+    if (initDnAsynClient(pMsg)) {
+	free(pcache);
+	return NULL;
+    }
+    
+    pPlc->wrCache = pcache;
+    return pcache;
 }
 
 
@@ -96,7 +330,6 @@ static void devXoDnCallback(struct plcMessage *pMsg) {
 static long init_output(struct dbCommon *prec, enum recType type, struct link *plink) {
     struct dpvtOut *dpvt;
     struct plcInfo *pPlc;
-    struct plcMessage *pMsg;
     struct wrCache *pcache;
     const int numWords = (type == AOF) ? 2 : 1;
     long status;
@@ -111,7 +344,6 @@ static long init_output(struct dbCommon *prec, enum recType type, struct link *p
 	return S_rec_outMem;
     }
     prec->dpvt = (void *) dpvt;
-    pMsg = &dpvt->msg;
     
     status = dnAsynAddr(prec, &dpvt->plcAddr, plink);
     if (status) {
@@ -122,16 +354,7 @@ static long init_output(struct dbCommon *prec, enum recType type, struct link *p
     
     dpvt->precord = prec;
     dpvt->type    = type;
-    
-    pMsg->port     = pPlc->port;
-    pMsg->proto    = pPlc->proto;
-    pMsg->callback = devXoDnCallback;
-    
-    status = initDnAsynClient(pMsg);
-    if (status) {
-	prec->pact = TRUE;
-	return status;
-    }
+    dpvt->nWords  = numWords;
     
     if ((dpvt->plcAddr.vAddr < WRITEMINADDR+DNREFOFFSET) ||
 	(dpvt->plcAddr.vAddr + numWords >= WRITEMAXADDR+DNREFOFFSET)) {
@@ -144,23 +367,15 @@ static long init_output(struct dbCommon *prec, enum recType type, struct link *p
     pcache = pPlc->wrCache;
     if (pcache == NULL) {
 	/* Not defined?  Create it */
-	pcache = (struct wrCache *) calloc(1, sizeof (struct wrCache));
+	pcache = new_wrcache(pPlc);
 	if (pcache == NULL) {
-	    errlogPrintf("devXoDnAsyn: calloc failed for \"%s\"\n", prec->name);
 	    prec->pact = TRUE;
 	    return S_rec_outMem;
 	}
-	pcache->mutex = epicsMutexMustCreate();
-	pPlc->wrCache = pcache;
     }
     
-    dpvt->mutex = pcache->mutex;
-    dpvt->wrItem = &pcache->item[dpvt->plcAddr.vAddr - WRITEMINADDR+DNREFOFFSET];
-    
-    pMsg->cmd   = (pPlc->slaveId << 8) | WRITEVMEM;
-    pMsg->len   = numWords * DN_PLCWORDLEN;
-    pMsg->addr  = dpvt->plcAddr.vAddr;
-    pMsg->pdata = dpvt->msgData;
+    dpvt->wrCache = pcache;
+    dpvt->wrItem = &pcache->item[wrIndex(dpvt->plcAddr.vAddr)];
     
     return 0;
 }
@@ -258,7 +473,11 @@ static void setup_write(struct dbCommon *prec) {
     if (devDnAsynDebug >= 35)
         printf ("devXoDnAsyn: setup_write entered for \"%s\"\n", prec->name);
 
-    epicsMutexMustLock(dpvt->mutex);
+    /* Caller must hold wrCache->mutex */
+    if (pitem->dirty) {
+	/* Last value wins, the earlier one was never sent */
+	dpvt->wrCache->nCoalesced++;
+    }
     switch(dpvt->type) {
 	struct aoRecord *ao;
 	struct boRecord *bo;
@@ -283,8 +502,7 @@ static void setup_write(struct dbCommon *prec) {
 	    pitem->word = mask & 0xffff;
 	    mask = (mask >> 16) & 0xffff;
 	    (pitem + 1)->word = mask;
-	    dpvt->msgData[2] = mask & 0xff;
-	    dpvt->msgData[3] = (mask >> 8) & 0xff;
+	    (pitem + 1)->dirty = TRUE;
 	    break;
 	
 	case BO:
@@ -305,19 +523,61 @@ static void setup_write(struct dbCommon *prec) {
 	    pitem->word = (pitem->word & ~mask) | (mbbod->rval & mask);
 	    break;
     }
-    dpvt->msgData[0] = pitem->word & 0xff;
-    dpvt->msgData[1] = (pitem->word >> 8) & 0xff;
-    epicsMutexUnlock(dpvt->mutex);
+    pitem->dirty = TRUE;
 
     if (devDnAsynDebug >= 10) {
-	printf("devXoDnAsyn: Send V%o = %d\n", dpvt->msg.addr, *dpvt->msg.pdata);
+	printf("devXoDnAsyn: Send V%o = %d\n",
+	       dpvt->plcAddr.vAddr - DNREFOFFSET, pitem->word);
     }
 }
 
+static int wr_request(struct dbCommon *prec) {
+    struct dpvtOut *dpvt = (struct dpvtOut *) prec->dpvt;
+    struct wrCache *pcache = dpvt->wrCache;
+    struct plcInfo *pPlc = pcache->plcInfo;
+    struct dpvtOut **pdpvt;
+    int prio = wr_priority(dpvt);
+    int raise = FALSE;
+    int status = 0;
+    
+    epicsMutexMustLock(pcache->mutex);
+    setup_write(prec);
+    for (pdpvt = &pcache->pending; *pdpvt; pdpvt = &(*pdpvt)->wrNext);
+    dpvt->wrNext = NULL;
+    *pdpvt = dpvt;
+    
+    if (pcache->active) {
+	/* Already queued, make sure it goes soon enough for this one */
+	if (prio > pcache->msg.priority) {
+	    pcache->msg.priority = prio;
+	    raise = TRUE;
+	}
+    } else {
+	pcache->active = TRUE;
+	pcache->msg.priority = prio;
+	if (pPlc->wrWindow > 0) {
+	    callbackRequestDelayed(&pcache->window, pPlc->wrWindow);
+	} else {
+	    status = dnAsynClientSend(&pcache->msg);
+	    if (status) {
+		/* Nothing else can be pending */
+		wr_discard(pcache->pending);
+		pcache->pending = NULL;
+		pcache->active = FALSE;
+	    }
+	}
+    }
+    epicsMutexUnlock(pcache->mutex);
+    
+    /* Re-queuing waits for our callback, which takes the mutex */
+    if (raise)
+	dnAsynClientPriority(&pcache->msg, prio);
+    return status;
+}
+
 
 static long write_data(struct dbCommon *prec) {
     struct dpvtOut *dpvt=(struct dpvtOut *)prec->dpvt;
-    struct plcMessage *pMsg;
     struct plcInfo *pPlc;
 
     if (devDnAsynDebug >= 35)
@@ -325,7 +585,6 @@ static long write_data(struct dbCommon *prec) {
 
     if (!dpvt) return S_dev_NoInit;
 
-    pMsg = &dpvt->msg;
     pPlc = dpvt->plcAddr.plcInfo;
     
     if (!prec->pact) {
@@ -337,32 +596,27 @@ static long write_data(struct dbCommon *prec) {
 	    printf("devXoDnAsyn: Sending data from \"%s\"\n",
 		   prec->name);
 	
-	/* Send the request */
-	setup_write(prec);
-	if (dnAsynClientSend(pMsg)) {
+	/* Queue the data for writing */
+	if (wr_request(prec)) {
 	    errlogPrintf("devXoDnAsyn: Asyn Send by \"%s\" failed\n", prec->name);
 	    recGblSetSevr(prec, WRITE_ALARM, MAJOR_ALARM);
 	    pPlc->nAsynFail++;
 	    return -1;
 	}
-	pPlc->nWrReqs++;
 	prec->pact=TRUE;
     } else {
 	/* Record busy, a transaction via ASYN has completed */
 	if (devDnAsynDebug >= 10) {
 	    printf("devXoDnAsyn: Got a reply for \"%s\"\n", 
 		    prec->name);
-	    printf("devXoDnAsyn: Write V%o = %d returned status %d\n",
-		    pMsg->addr, *pMsg->pdata, pMsg->status);
-	} else if (pMsg->status && devDnAsynDebug >= 5)
+	    printf("devXoDnAsyn: Write V%o returned status %d\n",
+		    dpvt->plcAddr.vAddr - DNREFOFFSET, dpvt->status);
+	} else if (dpvt->status && devDnAsynDebug >= 5)
 	    printf("devXoDnAsyn: Write reply for \"%s\" has status %d\n",
-		   prec->name, pMsg->status);
+		   prec->name, dpvt->status);
 	
-	if (pMsg->status == DN_SUCCESS) {
+	if (dpvt->status == DN_SUCCESS) {
 	    /* OK reply was received */
-	    pPlc->alarm = NO_ALARM;
-	    pPlc->nSuccess++;
-
 	    if (devDnAsynDebug >= 3) {
 		epicsTimeStamp tNow;
 		double duration;
@@ -371,20 +625,12 @@ static long write_data(struct dbCommon *prec) {
 		printf("devXoDnAsyn: Write for \"%s\" took %f seconds\n", 
 			prec->name, duration);
 	    }
-	} else if (pMsg->status > DN_TIMEOUT) {
-	    /* DirectNet I/O problem */
-	    errlogPrintf("devXoDnAsyn: DirectNet error %s writing %s to PLC \"%s\" on Asyn port \"%s\"\n",
-			 dn_error_strings[pMsg->status], prec->name, pPlc->name, pMsg->port);
+	} else if (dpvt->status > DN_TIMEOUT) {
+	    /* DirectNet I/O problem, logged by devXoDnCallback */
 	    recGblSetSevr(prec, WRITE_ALARM, INVALID_ALARM); 
-	    pPlc->alarm = INVALID_ALARM;
-	    pPlc->nDnFail++;
 	} else {
-	    /* ASYN I/O problem */
-	    errlogPrintf("devXoDnAsyn: dnAsyn error %s writing %s to PLC \"%s\" on Asyn port \"%s\"\n",
-			 dn_error_strings[pMsg->status], prec->name, pPlc->name, pMsg->port);
+	    /* ASYN I/O problem, logged by devXoDnCallback */
 	    recGblSetSevr(prec, WRITE_ALARM, MAJOR_ALARM);
-	    pPlc->alarm = MAJOR_ALARM;
-	    pPlc->nAsynFail++;
 	    return -1;
 	}
     }
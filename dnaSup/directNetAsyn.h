@@ -51,13 +51,27 @@ Version:
 #define DN_WRBLK_FAIL	7
 #define DN_NOT_EOT	8
 #define DN_GOT_EOT	9
+#define DN_PLC_DOWN	10
 
 /* timeouts in seconds */
 
 #define ENQACKDELAY (ENQACKTIME/1000.0 + 1.0)
 #define HDRACKDELAY (HDRACKTIME/1000.0 + 1.0)
 #define DATACKDELAY (DATACKTIME/1000.0 + 1.0)
-#define ACKEOTDELAY (ACKEOTTIME/1000.0 + 1.0)
+#define SIMDELAY    20.0	/* Simulator response */
+
+/* Adaptive timeouts are the latency mean plus DN_TMO_DEVS deviations,
+ * once DN_TMO_SAMPLES responses have been measured */
+#define DN_TMO_DEVS	4
+#define DN_TMO_SAMPLES	8
+#define DN_TMO_PROBE	8	/* Misses before a full-length wait */
+#define DN_TMO_MIN	0.05	/* Default shortest timeout */
+#define DN_TMO_DEV_MAX	60.0	/* Limit on the deviation after misses */
+
+/* A PLC is marked down after DN_TRIP_FAILS transactions in a row get no
+ * response, then probed every DN_PROBE_PERIOD seconds by default */
+#define DN_TRIP_FAILS	3
+#define DN_PROBE_PERIOD	5.0
 
 
 /* Misc values */
@@ -65,10 +79,18 @@ Version:
 #define MASTERID	0
 
 #define BAUDRATE	9600
-#define BYTERATE	(BAUDRATE/10)
+#define BYTERATE	(BAUDRATE/10.0)	/* Bytes per second */
 
-#define DN_RDDATA_MAX	32
+#define DN_RDDATA_MAX	32		/* Default read block size */
+#define DN_RDDATA_LIMIT	(4*BLOCK_LEN)	/* Largest configurable block */
 #define DN_PLCWORDLEN	2
 
+/* Link time of the select, header, framing, ACK and EOT exchanges for
+ * one read transaction, in bytes; used to plan the read blocks */
+#define DN_XACT_COST	48
+
+/* Most simulator requests that can be in flight on one pipelined port */
+#define DN_PIPE_MAX	64
+
 
 #endif /* INC_directNetAsyn_h */
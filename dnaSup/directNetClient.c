@@ -19,11 +19,18 @@ Author:
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <math.h>
 
 /* libCom */
 #include <errlog.h>
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
 #include <epicsTime.h>
 
+/* IOC */
+#include <callback.h>
+
 /* asyn */
 #include <asynDriver.h>
 #include <asynOctet.h>
@@ -33,6 +40,7 @@ Author:
 /* directNetAsyn */
 #include "directNetAsyn.h"
 #include "directNetClient.h"
+#include "dnTrace.h"
 
 /* Packet interface methods */
 
@@ -45,14 +53,53 @@ typedef struct plcProto {
         int cmd, int addr, const char *pdata, int len);
 } plcProto;
 
-/* Client data structure */
+/* Client data structures */
+
+struct simPipe;
+struct dnPort;
+struct dnConn;
+
+#define DN_RXBUF_SIZE 256
+#define DN_TXBUF_SIZE (BLOCK_LEN + 3)	/* Largest frame: STX data ETX LRC */
+
+/* I/O buffers, only used by one transaction at a time */
+typedef struct dnIo {
+    int rxHead;			/* Next unread byte in rxBuf */
+    int rxTail;			/* End of data in rxBuf */
+    char rxBuf[DN_RXBUF_SIZE];	/* Data read ahead from the port */
+    int txLen;			/* Bytes staged in txBuf */
+    char txLrc;			/* LRC of the staged frame body */
+    char txBuf[DN_TXBUF_SIZE];	/* Frame being sent */
+} dnIo;
 
 struct dnAsynClient {
     asynUser *pau;
     asynOctet *poctet;
     void *drvPvt;
+    dnIo *io;			/* Shared with the rest of conn */
+    struct dnConn *conn;
+    struct dnAsynClient *connNext;	/* Clients sharing conn */
+    struct plcLink *link;	/* Latency estimate, may be NULL */
+    struct dnPort *port;	/* Statistics for the Asyn port */
+    epicsTimeStamp tQueued;	/* When the request was sent */
+    epicsTimeStamp tMark;	/* End of the last phase timed */
+    struct dnAsynClient *qNext;	/* Port's list of queued requests */
+    struct dnAsynClient *qPrev;
+    int qState;			/* See dncSetState() */
+    enum dnPhase phase;		/* Last phase reached, for the trace */
+    int retries;		/* Failed attempts, for the trace */
+    unsigned char heard;	/* Got a reply in this transaction */
+    CALLBACK lost;		/* Completes a request dropped from the
+				 * queue, see dncLost() */
+    struct simPipe *pipe;	/* Non-NULL if requests are pipelined */
+    unsigned char simBinary;	/* Binary data frames wanted */
 };
 
+/* Simulator data encodings, see simCheckMode() */
+#define SIM_ASCII	0
+#define SIM_ASK		1	/* Binary not negotiated yet */
+#define SIM_BINARY	2
+
 
 const char *dn_error_strings[] = {
     "DN_SUCCESS",
@@ -64,12 +111,374 @@ const char *dn_error_strings[] = {
     "DN_RDBLK_FAIL",
     "DN_WRBLK_FAIL",
     "DN_NOT_EOT",
-    "DN_GOT_EOT"
+    "DN_GOT_EOT",
+    "DN_PLC_DOWN"
 };
 
 int dnAsynMaxRetries = MAX_RETRIES;
 
 
+/* Adaptive timeouts
+ *
+ * Each PLC's response latency is tracked as a smoothed mean and mean
+ * deviation, as TCP does for its round trip time. Once enough responses
+ * have been measured the timeout is the mean plus DN_TMO_DEVS deviations,
+ * kept between the link's tmoMin and the protocol's own limit. A miss
+ * widens the deviation, and after DN_TMO_PROBE misses in a row one wait
+ * runs for the full protocol time so a PLC that has become slower can
+ * still be heard. The link's tmoMax caps every timeout.
+ */
+
+static double dnpTimeoutMax(const struct plcLink *link, double limit) {
+    if (link && link->tmoMax > 0 && limit > link->tmoMax)
+	return link->tmoMax;
+    return limit;
+}
+
+static double dnpTimeout(const struct plcLink *link, double limit) {
+    double tmo = limit;
+    
+    if (!link) return limit;
+    if (link->nSamples >= DN_TMO_SAMPLES && link->nMissed < DN_TMO_PROBE) {
+	tmo = link->mean + DN_TMO_DEVS * link->dev;
+	if (tmo < link->tmoMin) tmo = link->tmoMin;
+	if (tmo > limit) tmo = limit;
+    }
+    return dnpTimeoutMax(link, tmo);
+}
+
+static double dnpElapsed(const epicsTimeStamp *pstart) {
+    epicsTimeStamp T_now;
+    
+    epicsTimeGetCurrent(&T_now);
+    return epicsTimeDiffInSeconds(&T_now, pstart);
+}
+
+static void dnpLatency(struct plcLink *link, double sample) {
+    double err;
+    
+    if (!link) return;
+    if (sample < 0) sample = 0;
+    if (link->nSamples++ == 0) {
+	link->mean = sample;
+	link->dev = sample / 2;
+    } else {
+	err = sample - link->mean;
+	link->mean += err / 8;
+	link->dev += (fabs(err) - link->dev) / 4;
+    }
+    link->nMissed = 0;
+}
+
+static void dnpMissed(struct plcLink *link) {
+    double least;
+    
+    if (!link) return;
+    link->nTimeouts++;
+    if (++link->nMissed > DN_TMO_PROBE)
+	link->nMissed = 0;
+    
+    /* Widen from a floor, after steady samples the deviation may be 0 */
+    least = link->mean / 4;
+    if (least < link->tmoMin / DN_TMO_DEVS)
+	least = link->tmoMin / DN_TMO_DEVS;
+    if (link->dev < least)
+	link->dev = least;
+    link->dev *= 2;
+    if (link->dev > DN_TMO_DEV_MAX)
+	link->dev = DN_TMO_DEV_MAX;
+}
+
+
+/* PLC health
+ *
+ * A PLC that fails to answer DN_TRIP_FAILS transactions in a row is
+ * marked down. Its requests then fail at once with DN_PLC_DOWN instead of
+ * tying up the port through the select retries, except that one request
+ * every probePeriod seconds is sent to find out whether it has recovered.
+ * Any response at all, even a NAK, returns the PLC to healthy.
+ */
+
+static int dnpHealthCheck(struct plcLink *link) {
+    epicsTimeStamp T_now;
+    
+    if (!link || link->health != plcDown) return DN_SUCCESS;
+    
+    epicsTimeGetCurrent(&T_now);
+    if (epicsTimeLessThan(&T_now, &link->nextProbe)) {
+	link->nFastFails++;
+	return DN_PLC_DOWN;
+    }
+    
+    /* Let this one through as a probe */
+    link->nProbes++;
+    link->nextProbe = T_now;
+    epicsTimeAddSeconds(&link->nextProbe, link->probePeriod);
+    return DN_SUCCESS;
+}
+
+static void dnpHealthUpdate(struct plcMessage *pMsg, int responded) {
+    struct plcLink *link = pMsg->link;
+    
+    if (!link) return;
+    if (responded) {
+	if (link->health == plcDown)
+	    errlogPrintf("directNetClient: PLC %d on Asyn port \"%s\" is responding again\n",
+			 pMsg->cmd >> 8, pMsg->port);
+	link->health = plcHealthy;
+	link->nFailed = 0;
+	return;
+    }
+    if (link->health == plcDown) return;
+    
+    link->health = plcSuspect;
+    if (++link->nFailed >= DN_TRIP_FAILS && link->probePeriod > 0) {
+	/* Logged only here, requests failed while down are not */
+	errlogPrintf("directNetClient: PLC %d on Asyn port \"%s\" is not responding, failing its requests\n",
+		     pMsg->cmd >> 8, pMsg->port);
+	link->health = plcDown;
+	link->nTrips++;
+	epicsTimeGetCurrent(&link->nextProbe);
+	epicsTimeAddSeconds(&link->nextProbe, link->probePeriod);
+    }
+}
+
+
+/* Transaction statistics
+ *
+ * Each phase of a transaction is timed into histograms for the PLC and
+ * for its Asyn port, and the bytes sent and received are counted. The
+ * counters are only ever incremented, atomically, so the port thread
+ * never waits for a reader.
+ */
+
+typedef struct dnPort {
+    struct dnPort *pNext;
+    const char *name;
+    int index;			/* Identifies the port in trace records */
+    struct dnStats stats;
+    epicsMutexId lock;		/* Protects backlog .. qTail */
+    struct dnBacklog backlog;
+    dnAsynClient *qHead;	/* Queued requests, oldest first */
+    dnAsynClient *qTail;
+    struct plcLink *session;	/* DirectNet slave left selected, only
+				 * used from the port thread */
+    int sessionConn;		/* Value of nConnects when session set */
+    int nConnects;		/* Connection changes, atomic */
+    int simMode;		/* Simulator data encoding, port thread only */
+    int simConn;		/* Value of nConnects when simMode set */
+} dnPort;
+
+typedef struct dnConn {
+    struct dnConn *pNext;
+    dnPort *port;
+    struct plcLink *link;	/* The PLC, or NULL if not shared */
+    asynUser *pau;		/* For exceptions */
+    asynOctet *poctet;
+    void *drvPvt;
+    dnAsynClient *clients;	/* Using this dnConn, via connNext */
+    dnAsynClient *free;		/* Client structures not yet used */
+    dnIo io;
+} dnConn;
+
+static dnPort *dnPorts;
+static int dnNPorts;
+static epicsMutexId dnPortLock;
+static epicsThreadOnceId dnPortOnce = EPICS_THREAD_ONCE_INIT;
+
+static void dncPortInit(void *arg) {
+    dnPortLock = epicsMutexMustCreate();
+}
+
+static dnPort * dncPortFind(const char *name) {
+    dnPort *pport;
+    
+    for (pport = dnPorts; pport; pport = pport->pNext) {
+	if (strcmp(pport->name, name) == 0)
+	    break;
+    }
+    return pport;
+}
+
+static dnPort * dncPortGet(const char *name) {
+    dnPort *pport;
+    
+    epicsThreadOnce(&dnPortOnce, dncPortInit, NULL);
+    epicsMutexMustLock(dnPortLock);
+    pport = dncPortFind(name);
+    if (!pport) {
+	pport = (dnPort *) calloc(1, sizeof(dnPort));
+	if (pport) {
+	    pport->name = name;
+	    pport->index = dnNPorts++;
+	    pport->lock = epicsMutexMustCreate();
+	    pport->simConn = -1;	/* simMode not set */
+	    pport->pNext = dnPorts;
+	    dnPorts = pport;
+	} else
+	    errlogPrintf("directNetClient: calloc failed for port \"%s\"\n",
+			 name);
+    }
+    epicsMutexUnlock(dnPortLock);
+    return pport;
+}
+
+/* Ports are never deleted, so what this finds stays valid */
+static dnPort * dncPortLookup(const char *name) {
+    dnPort *pport;
+    
+    epicsThreadOnce(&dnPortOnce, dncPortInit, NULL);
+    epicsMutexMustLock(dnPortLock);
+    pport = dncPortFind(name);
+    epicsMutexUnlock(dnPortLock);
+    return pport;
+}
+
+static void dncHistAdd(struct dnHist *phist, double secs) {
+    double limit = DN_HIST_BASE;
+    int bin = 0;
+    
+    while (secs >= limit && bin < DN_HIST_BINS - 1) {
+	limit *= 2;
+	bin++;
+    }
+    epicsAtomicIncrSizeT(&phist->count);
+    epicsAtomicAddSizeT(&phist->sumUs, (size_t) (secs * 1e6));
+    epicsAtomicIncrSizeT(&phist->bins[bin]);
+}
+
+/* Time a phase from *pfrom until now, which becomes the next mark */
+static void dncTime(dnAsynClient *pclient, enum dnPhase phase,
+    const epicsTimeStamp *pfrom) {
+    epicsTimeStamp T_now;
+    double secs;
+    
+    epicsTimeGetCurrent(&T_now);
+    secs = epicsTimeDiffInSeconds(&T_now, pfrom);
+    if (secs < 0) secs = 0;
+    if (pclient->link)
+	dncHistAdd(&pclient->link->stats.phase[phase], secs);
+    if (pclient->port)
+	dncHistAdd(&pclient->port->stats.phase[phase], secs);
+    if (phase != dnPhaseService)
+	pclient->phase = phase;
+    pclient->tMark = T_now;
+}
+
+/* Request states, for the backlog counts */
+#define DNC_IDLE	0
+#define DNC_QUEUED	1
+#define DNC_ACTIVE	2
+
+static void dncBacklogAdd(struct dnBacklog *pbl, int dQueued, int dInFlight) {
+    pbl->queued += dQueued;
+    pbl->inFlight += dInFlight;
+    if (pbl->queued + pbl->inFlight > pbl->maxBacklog)
+	pbl->maxBacklog = pbl->queued + pbl->inFlight;
+}
+
+static void dncSetState(dnAsynClient *pclient, int state) {
+    dnPort *pport = pclient->port;
+    int old = pclient->qState;
+    int dQueued = (state == DNC_QUEUED) - (old == DNC_QUEUED);
+    int dInFlight = (state == DNC_ACTIVE) - (old == DNC_ACTIVE);
+    
+    if (!pport || state == old) return;
+    
+    epicsMutexMustLock(pport->lock);
+    if (old == DNC_QUEUED) {
+	if (pclient->qPrev) pclient->qPrev->qNext = pclient->qNext;
+	else pport->qHead = pclient->qNext;
+	if (pclient->qNext) pclient->qNext->qPrev = pclient->qPrev;
+	else pport->qTail = pclient->qPrev;
+    }
+    if (state == DNC_QUEUED) {
+	pclient->qNext = NULL;
+	pclient->qPrev = pport->qTail;
+	if (pport->qTail) pport->qTail->qNext = pclient;
+	else pport->qHead = pclient;
+	pport->qTail = pclient;
+    }
+    dncBacklogAdd(&pport->backlog, dQueued, dInFlight);
+    if (pclient->link)
+	dncBacklogAdd(&pclient->link->backlog, dQueued, dInFlight);
+    pclient->qState = state;
+    epicsMutexUnlock(pport->lock);
+}
+
+static void dncBytes(dnAsynClient *pclient, int tx, size_t n) {
+    if (pclient->link)
+	epicsAtomicAddSizeT(tx ? &pclient->link->stats.txBytes :
+				 &pclient->link->stats.rxBytes, n);
+    if (pclient->port)
+	epicsAtomicAddSizeT(tx ? &pclient->port->stats.txBytes :
+				 &pclient->port->stats.rxBytes, n);
+}
+
+
+/* Transaction trace
+ *
+ * Every finished transaction leaves a dnTraceRec in a ring that holds the
+ * most recent DN_TRACE_SIZE of them. Writers claim a slot by incrementing
+ * dnTraceNext and take no locks; a slot's seq is zero while it is being
+ * filled in, so a reader copying the ring can tell records it caught
+ * half-written or overwritten and drop them.
+ */
+
+#define DN_TRACE_SIZE 4096
+
+static dnTraceRec dnTraceRing[DN_TRACE_SIZE];
+static size_t dnTraceNext;
+
+static void dncTrace(struct plcMessage *pMsg, int status) {
+    dnAsynClient *pclient = pMsg->pClient;
+    size_t n = epicsAtomicIncrSizeT(&dnTraceNext);
+    dnTraceRec *prec = &dnTraceRing[(n - 1) % DN_TRACE_SIZE];
+    epicsTimeStamp T_now;
+    double secs;
+
+    epicsTimeGetCurrent(&T_now);
+    secs = epicsTimeDiffInSeconds(&T_now, &pclient->tQueued);
+
+    prec->seq = 0;
+    epicsAtomicWriteMemoryBarrier();
+    prec->secPastEpoch = T_now.secPastEpoch;
+    prec->nsec = T_now.nsec;
+    prec->usecs = secs > 0 ? (epicsUInt32) (secs * 1e6) : 0;
+    prec->cmd = pMsg->cmd;
+    prec->addr = pMsg->addr;
+    prec->len = pMsg->len;
+    prec->port = pclient->port && pclient->port->index < 0xff ?
+	pclient->port->index : 0xff;
+    prec->phase = pclient->phase;
+    prec->status = status;
+    prec->retries = pclient->retries > 255 ? 255 : pclient->retries;
+    epicsAtomicWriteMemoryBarrier();
+    prec->seq = (epicsUInt32) n;
+}
+
+/* Copy the last count records (all if count <= 0) still in the ring,
+ * returning how many were copied */
+static int dncTraceCopy(dnTraceRec *pbuf, int count) {
+    size_t next = epicsAtomicGetSizeT(&dnTraceNext);
+    size_t n = next < DN_TRACE_SIZE ? next : DN_TRACE_SIZE;
+    int got = 0;
+
+    if (count > 0 && n > (size_t) count) n = count;
+    for (n = next - n; n < next; n++) {
+	const dnTraceRec *prec = &dnTraceRing[n % DN_TRACE_SIZE];
+	epicsUInt32 seq = prec->seq;
+
+	epicsAtomicReadMemoryBarrier();
+	pbuf[got] = *prec;
+	epicsAtomicReadMemoryBarrier();
+	if (seq == (epicsUInt32) (n + 1) && prec->seq == seq)
+	    got++;
+    }
+    return got;
+}
+
+
 /* asynOctet interface routines */
 
 static void dnpSend(dnAsynClient *pclient, const char *pdata, int len) {
@@ -81,6 +490,7 @@ static void dnpSend(dnAsynClient *pclient, const char *pdata, int len) {
     
     status = pclient->poctet->write(pclient->drvPvt, pau, pdata, len, &wrote);
     if (status == asynSuccess) {
+	dncBytes(pclient, 1, wrote);
 	asynPrintIO(pau, ASYN_TRACEIO_DEVICE, pdata, len,
 		    "dnpSend: sent %lu of %d bytes\n",
                     (unsigned long) wrote, len);
@@ -90,56 +500,127 @@ static void dnpSend(dnAsynClient *pclient, const char *pdata, int len) {
     }
 }
 
-static int dnpGets(dnAsynClient *pclient, char *pdata, int len) {
+static int dnpFill(dnAsynClient *pclient, char *pdata, int len) {
     asynUser *pau = pclient->pau;
     asynStatus status;
     size_t got;
     int why;
-    asynPrint(pau, ASYN_TRACE_FLOW,
-	      "dnpGets(%p, %p, %d)\n", pclient, pdata, len);
     
     status = pclient->poctet->read(pclient->drvPvt, pau, pdata, len, &got, &why);
     if (status == asynSuccess) {
-	int trace = ASYN_TRACEIO_DEVICE;
-	int retval = 0;
-	if (got != len) {
-	    trace |= ASYN_TRACE_ERROR;
-	    retval = -1;
-	}
-	asynPrintIO(pau, trace, pdata, got,
-		    "dnpGets: Got %lu of %d bytes, reason 0x%x\n",
-		    (unsigned long) got, len, why);
-	return retval;
+	dncBytes(pclient, 0, got);
+	if (got > 0)
+	    pclient->heard = 1;
+	asynPrintIO(pau, ASYN_TRACEIO_DEVICE, pdata, got,
+		    "dnpFill: Got %lu bytes, reason 0x%x\n",
+		    (unsigned long) got, why);
+	return got;
     } else if (status == asynTimeout) {
-	struct plcMessage* pMsg = (struct plcMessage*) pau->userPvt;
 	asynPrint(pau, ASYN_TRACE_FLOW,
-		  "dnpGets: Read timeout from Asyn port \"%s\"\n", 
-		  pMsg->port);
+		  "dnpFill: Read timeout from Asyn port \"%s\"\n", 
+		  pclient->port->name);
     } else {
 	asynPrint(pau, ASYN_TRACE_ERROR,
-		    "dnpGets: Read failed: %s\n", pau->errorMessage);
+		    "dnpFill: Read failed: %s\n", pau->errorMessage);
     }
     return -1;
 }
 
+/* Input is read into the client's rxBuf as it arrives, and the byte and
+ * block requests are served from there. Larger blocks are read straight
+ * into the caller's buffer. The pau->timeout applies to the whole call.
+ */
+static int dnpGets(dnAsynClient *pclient, char *pdata, int len) {
+    asynUser *pau = pclient->pau;
+    int avail = pclient->io->rxTail - pclient->io->rxHead;
+    double timeout = pau->timeout;
+    epicsTimeStamp T_end;
+    int retval = 0;
+    asynPrint(pau, ASYN_TRACE_FLOW,
+	      "dnpGets(%p, %p, %d)\n", pclient, pdata, len);
+    
+    if (avail >= len) {
+	memcpy(pdata, &pclient->io->rxBuf[pclient->io->rxHead], len);
+	pclient->io->rxHead += len;
+	return 0;
+    }
+    memcpy(pdata, &pclient->io->rxBuf[pclient->io->rxHead], avail);
+    pdata += avail;
+    len -= avail;
+    pclient->io->rxHead = pclient->io->rxTail = 0;
+    
+    epicsTimeGetCurrent(&T_end);
+    epicsTimeAddSeconds(&T_end, timeout);
+    
+    while (len > 0) {
+	epicsTimeStamp T_now;
+	int got;
+	
+	if (len >= DN_RXBUF_SIZE) {
+	    got = dnpFill(pclient, pdata, len);
+	    if (got < 0) break;
+	} else {
+	    got = dnpFill(pclient, pclient->io->rxBuf, DN_RXBUF_SIZE);
+	    if (got < 0) break;
+	    pclient->io->rxTail = got;
+	    if (got > len) got = len;
+	    memcpy(pdata, pclient->io->rxBuf, got);
+	    pclient->io->rxHead = got;
+	}
+	pdata += got;
+	len -= got;
+	
+	epicsTimeGetCurrent(&T_now);
+	pau->timeout = epicsTimeDiffInSeconds(&T_end, &T_now);
+	if (len > 0 && pau->timeout <= 0) break;
+    }
+    
+    if (len > 0) {
+	asynPrint(pau, ASYN_TRACE_FLOW,
+		  "dnpGets: %d bytes missing\n", len);
+	retval = -1;
+    }
+    pau->timeout = timeout;
+    return retval;
+}
+
 static int dnpGetc(dnAsynClient *pclient) {
     unsigned char reply[1]; /* 0..255 */
     int result;
-    asynPrint(pclient->pau, ASYN_TRACE_FLOW,
-	      "dnpGetc(%p)\n", pclient);
+    
+    if (pclient->io->rxHead < pclient->io->rxTail)
+	return (unsigned char) pclient->io->rxBuf[pclient->io->rxHead++];
     
     result = dnpGets(pclient, (char *) reply, 1);
     return result ? result : reply[0];
 }
 
+static void dnpFlush(dnAsynClient *pclient) {
+    asynPrint(pclient->pau, ASYN_TRACE_FLOW,
+	      "dnpFlush(%p)\n", pclient);
+    
+    pclient->io->rxHead = pclient->io->rxTail = 0;
+    pclient->poctet->flush(pclient->drvPvt, pclient->pau);
+}
+
 static int dnpSendGetc(dnAsynClient *pclient, char *pdata, int len) {
     asynUser *pau = pclient->pau;
+    epicsTimeStamp T_start;
+    int reply;
     asynPrint(pau, ASYN_TRACE_FLOW,
 	      "dnpSendGetc(%p, %p, %d)\n", pclient, pdata, len);
     
-    pclient->poctet->flush(pclient->drvPvt, pau);
+    dnpFlush(pclient);
+    epicsTimeGetCurrent(&T_start);
     dnpSend(pclient, pdata, len);
-    return dnpGetc(pclient);
+    reply = dnpGetc(pclient);
+    
+    /* The latency excludes the time to send our frame */
+    if (reply >= 0)
+	dnpLatency(pclient->link, dnpElapsed(&T_start) - len / BYTERATE);
+    else
+	dnpMissed(pclient->link);
+    return reply;
 }
 
 
@@ -156,6 +637,47 @@ static char dnpLRC(dnAsynClient *pclient, const char *pdata, int len) {
     return lrc;
 }
 
+/* Outgoing frames are staged in the client's txBuf, computing the LRC
+ * as the body is added so the data is only touched once.
+ */
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static void dnpTxStart(dnAsynClient *pclient, char first) {
+    pclient->io->txBuf[0] = first;
+    pclient->io->txLen = 1;
+    pclient->io->txLrc = 0;
+}
+
+static void dnpTxData(dnAsynClient *pclient, const char *pdata, int len) {
+    char *next = &pclient->io->txBuf[pclient->io->txLen];
+    char lrc = pclient->io->txLrc;
+    
+    pclient->io->txLen += len;
+    while (len--) {
+	lrc ^= *pdata;
+	*next++ = *pdata++;
+    }
+    pclient->io->txLrc = lrc;
+}
+
+static void dnpTxHex(dnAsynClient *pclient, unsigned int val, int digits) {
+    char *next = &pclient->io->txBuf[pclient->io->txLen + digits];
+    char lrc = pclient->io->txLrc;
+    
+    pclient->io->txLen += digits;
+    while (digits--) {
+	*--next = hexDigits[val & 0xf];
+	lrc ^= *next;
+	val >>= 4;
+    }
+    pclient->io->txLrc = lrc;
+}
+
+static void dnpTxEnd(dnAsynClient *pclient, char last) {
+    pclient->io->txBuf[pclient->io->txLen++] = last;
+    pclient->io->txBuf[pclient->io->txLen++] = pclient->io->txLrc;
+}
+
 static int dnpSelect(dnAsynClient *pclient, int target) {
     asynUser *pau = pclient->pau;
     char reselect[4], *select = &reselect[1];
@@ -169,9 +691,10 @@ static int dnpSelect(dnAsynClient *pclient, int target) {
     reselect[1] = SEQCHAR;
     reselect[2] = slaveId;
     reselect[3] = ENQCHAR;
-    pau->timeout = ENQACKDELAY + 4 / BYTERATE;
     do {
-	int reply = dnpSendGetc(pclient, select, sendlen);
+	int reply;
+	pau->timeout = dnpTimeout(pclient->link, ENQACKDELAY) + 4 / BYTERATE;
+	reply = dnpSendGetc(pclient, select, sendlen);
 	while (reply > 0 && reply != SEQCHAR && reply != EOTCHAR) {
 	    asynPrint(pau, ASYN_TRACE_ERROR,
 		      "dnpSelect: Not SEQ/EOT - %d (retries = %d)\n",
@@ -183,32 +706,98 @@ static int dnpSelect(dnAsynClient *pclient, int target) {
 	    ACKCHAR == dnpGetc(pclient)) {
 	    return DN_SUCCESS;
 	}
+	pclient->retries++;
 	select = reselect;
 	sendlen = 4;
     } while (--retries > 0);
     return DN_SEL_FAIL;
 }
 
+/* A DirectNet session normally ends with an EOT from the master after each
+ * transaction. For PLCs with the session option set the EOT is held back
+ * when another request for the same PLC is waiting on the port or is about
+ * to be sent by the message's owner, and that transaction then sends its
+ * header without selecting the slave again. Any other transaction sends
+ * the EOT first.
+ */
+static void dnpEOT(dnAsynClient *pclient);
+
+static int dnpResume(dnAsynClient *pclient) {
+    struct dnPort *pport = pclient->port;
+    struct plcLink *session = pport ? pport->session : NULL;
+    
+    if (!session) return 0;
+    pport->session = NULL;
+    if (pport->sessionConn != epicsAtomicGetIntT(&pport->nConnects))
+	return 0;		/* Reconnected, the slave has forgotten */
+    if (session == pclient->link) return 1;
+    dnpEOT(pclient);
+    return 0;
+}
+
+static void dnpEnd(dnAsynClient *pclient, int status) {
+    struct plcMessage *pMsg = (struct plcMessage *) pclient->pau->userPvt;
+    struct dnPort *pport = pclient->port;
+    struct plcLink *link = pclient->link;
+    
+    if (status == DN_SUCCESS && pport && link && link->session) {
+	dnAsynClient *pnext;
+	
+	epicsMutexMustLock(pport->lock);
+	for (pnext = pport->qHead; pnext; pnext = pnext->qNext)
+	    if (pnext->link == link) break;
+	epicsMutexUnlock(pport->lock);
+	if (pnext || (pMsg->more && pMsg->more(pMsg))) {
+	    pport->session = link;
+	    pport->sessionConn = epicsAtomicGetIntT(&pport->nConnects);
+	    return;
+	}
+    }
+    dnpEOT(pclient);
+}
+
 static int dnpHeader(dnAsynClient *pclient, int cmd, int addr, int len) {
     asynUser *pau = pclient->pau;
     int reply, retries = dnAsynMaxRetries;
-    char header[HEADER_LEN];
+    int resumed = dnpResume(pclient);
     asynPrint(pau, ASYN_TRACE_FLOW,
 	      "dnpHeader(%p, %d, %d, %d)\n", pclient, cmd, addr, len);
     
-    reply = dnpSelect(pclient, (cmd >> 8) & 0xff);
-    if (reply) return reply;
+    if (!resumed) {
+	reply = dnpSelect(pclient, (cmd >> 8) & 0xff);
+	dncTime(pclient, dnPhaseSelect, &pclient->tMark);
+	if (reply) return reply;
+    }
     
-    sprintf((char *) header, "%c%4.4X%4.4X%4.4X%2.2X%c", 
-	    SOHCHAR, cmd, addr, len, MASTERID, ETBCHAR);
-    header[HEADER_LEN-1] = dnpLRC(pclient, &header[1], HEADER_LEN - 3);
-    pau->timeout = HDRACKDELAY + HEADER_LEN / BYTERATE;
+    dnpTxStart(pclient, SOHCHAR);
+    dnpTxHex(pclient, cmd, 4);
+    dnpTxHex(pclient, addr, 4);
+    dnpTxHex(pclient, len, 4);
+    dnpTxHex(pclient, MASTERID, 2);
+    dnpTxEnd(pclient, ETBCHAR);
 
     do {
-	reply = dnpSendGetc(pclient, header, HEADER_LEN);
-	if (reply == ACKCHAR) return DN_SUCCESS;
-	if (reply == EOTCHAR) return DN_GOT_EOT;
+	pau->timeout = dnpTimeout(pclient->link, HDRACKDELAY) +
+	    HEADER_LEN / BYTERATE;
+	reply = dnpSendGetc(pclient, pclient->io->txBuf, pclient->io->txLen);
+	if (reply != ACKCHAR && resumed) {
+	    /* The PLC may have ended the session, so select it again */
+	    int status;
+	    
+	    resumed = 0;
+	    pclient->retries++;
+	    dnpEOT(pclient);
+	    status = dnpSelect(pclient, (cmd >> 8) & 0xff);
+	    dncTime(pclient, dnPhaseSelect, &pclient->tMark);
+	    if (status) return status;
+	    reply = NAKCHAR;	/* Send the header again */
+	} else if (reply == NAKCHAR) pclient->retries++;
     } while (reply == NAKCHAR && --retries > 0);
+    if (resumed && reply == ACKCHAR && pclient->link)
+	pclient->link->nResumed++;
+    dncTime(pclient, dnPhaseHeader, &pclient->tMark);
+    if (reply == ACKCHAR) return DN_SUCCESS;
+    if (reply == EOTCHAR) return DN_GOT_EOT;
     if (reply != NAKCHAR)
 	asynPrint(pau, ASYN_TRACE_ERROR,
 		  "dnpHeader: Not ACK/NAK/EOT - %d (retries = %d)\n",
@@ -218,7 +807,6 @@ static int dnpHeader(dnAsynClient *pclient, int cmd, int addr, int len) {
 
 static int dnpWrBlk(dnAsynClient *pclient, const char *pdata, int len) {
     asynUser *pau = pclient->pau;
-    char block[BLOCK_LEN + 3];
     int blen = len;
     int reply, retries = dnAsynMaxRetries;
     asynPrint(pau, ASYN_TRACE_FLOW,
@@ -227,14 +815,15 @@ static int dnpWrBlk(dnAsynClient *pclient, const char *pdata, int len) {
     if (blen > BLOCK_LEN) blen = BLOCK_LEN;
     len -= blen;
     
-    block[0] = STXCHAR;
-    memcpy(&block[1], pdata, blen);
-    block[blen+1] = len ? ETBCHAR : ETXCHAR;
-    block[blen+2] = dnpLRC(pclient, &block[1], blen);
-    pau->timeout = DATACKDELAY + (BLOCK_LEN + 3) / BYTERATE;
+    dnpTxStart(pclient, STXCHAR);
+    dnpTxData(pclient, pdata, blen);
+    dnpTxEnd(pclient, len ? ETBCHAR : ETXCHAR);
     do {
-	reply = dnpSendGetc(pclient, block, blen + 3);
+	pau->timeout = dnpTimeout(pclient->link, DATACKDELAY) +
+	    (BLOCK_LEN + 3) / BYTERATE;
+	reply = dnpSendGetc(pclient, pclient->io->txBuf, pclient->io->txLen);
 	if (reply == ACKCHAR) return DN_SUCCESS;
+	pclient->retries++;
     } while (reply == NAKCHAR && --retries > 0);
     return DN_WRBLK_FAIL;
 }
@@ -248,7 +837,10 @@ static int dnpRdBlk(dnAsynClient *pclient, char *pdata, int len) {
     
     if (blen > BLOCK_LEN) blen = BLOCK_LEN;
     len -= blen;
-    pau->timeout = DATACKDELAY + BLOCK_LEN / BYTERATE;
+    /* The measured latency is for ACKs; a data block also includes the
+     * time the PLC takes to fetch the data, so it gets the full wait */
+    pau->timeout = dnpTimeoutMax(pclient->link, DATACKDELAY) +
+	BLOCK_LEN / BYTERATE;
     do {
 	static const char ack = ACKCHAR, nak = NAKCHAR;
 	reply = dnpGetc(pclient);
@@ -259,12 +851,13 @@ static int dnpRdBlk(dnAsynClient *pclient, char *pdata, int len) {
 	if ((reply >= 0) &&
 	    (dnpGets(pclient, pdata, blen) == DN_SUCCESS) &&
 	    (dnpGetc(pclient) == (len ? ETBCHAR : ETXCHAR)) &&
-	    (dnpGetc(pclient) == dnpLRC(pclient, pdata, blen))) {
+	    (dnpGetc(pclient) == (0xff & dnpLRC(pclient, pdata, blen)))) {
 	    dnpSend(pclient, &ack, 1);
 	    return DN_SUCCESS;
 	}
 	
 	dnpSend(pclient, &nak, 1);
+	pclient->retries++;
     } while (--retries > 0);
     return DN_RDBLK_FAIL;
 }
@@ -292,8 +885,11 @@ static int dnpWrite(dnAsynClient *pclient, int cmd, int addr, const char *pdata,
 		len -= BLOCK_LEN;
 		pdata += BLOCK_LEN;
 	    } while ((status == DN_SUCCESS) && (len > 0));
+	    dncTime(pclient, dnPhaseData, &pclient->tMark);
 	}
-	dnpEOT(pclient);
+	dnpEnd(pclient, status);
+	dncTime(pclient, dnPhaseEOT, &pclient->tMark);
+	if (status == DN_GOT_EOT) pclient->retries++;
     } while ((status == DN_GOT_EOT) && (--retries > 0));
     return status;
 }
@@ -310,10 +906,13 @@ static int dnpRead(dnAsynClient *pclient, int cmd, int addr, char *pdata, int le
 		len -= BLOCK_LEN;
 		pdata += BLOCK_LEN;
 	    } while ((status == DN_SUCCESS) && (len > 0));
+	    dncTime(pclient, dnPhaseData, &pclient->tMark);
 	}
 	if ((status == DN_SUCCESS) &&
 	    (dnpGetc(pclient) != EOTCHAR)) status = DN_NOT_EOT;
-	dnpEOT(pclient);
+	dnpEnd(pclient, status);
+	dncTime(pclient, dnPhaseEOT, &pclient->tMark);
+	if (status == DN_GOT_EOT) pclient->retries++;
     } while ((status == DN_GOT_EOT) && (--retries > 0));
     return status;
 }
@@ -325,21 +924,29 @@ const plcProto dnpProto = {
 
 /* Simulator protocol implementation */
 
-static void simCommand(dnAsynClient *pclient, int cmd, int addr, int len) {
+static void simCommand(dnAsynClient *pclient, int cmd, int addr, int len,
+    int tag)
+{
     asynUser *pau = pclient->pau;
     int id = (cmd >> 8) & 0xff;
     char msg = (cmd & WRITECMD) ? 'W' : 'R';
-    char command[2+3+3+5+5+1+1]; /* <m:1> <id:2> <cmd:2> <addr:4> <len:4> */
+    char command[2+3+3+5+5+3+1+1]; /* <m:1> <id:2> <cmd:2> <addr:4> <len:4> <tag:2> */
 
     asynPrint(pau, ASYN_TRACE_FLOW,
-        "simCommand(%p, %d, %d, %d)\n", pclient, cmd, addr, len);
+        "simCommand(%p, %d, %d, %d, %d)\n", pclient, cmd, addr, len, tag);
 
-    /* Encode the command as ASCII */
-    sprintf(command, "%c %2.2x %2.2x %4.4x %4.4x\n",
-        msg, id, cmd & 0xff, addr, len);
+    /* Encode the command as ASCII, a tag is only sent when pipelining */
+    if (tag < 0)
+        sprintf(command, "%c %2.2x %2.2x %4.4x %4.4x\n",
+            msg, id, cmd & 0xff, addr, len);
+    else
+        sprintf(command, "%c %2.2x %2.2x %4.4x %4.4x %2.2x\n",
+            msg, id, cmd & 0xff, addr, len, tag);
     dnpSend(pclient, command, strlen(command));
 }
 
+static const char simHexDigits[] = "0123456789abcdef";
+
 static void simWriteMsg(dnAsynClient *pclient, const char *pdata, int len) {
     asynUser *pau = pclient->pau;
     char *next;
@@ -353,13 +960,70 @@ static void simWriteMsg(dnAsynClient *pclient, const char *pdata, int len) {
 
     next = block + sprintf(block, "D %2.2x ", len);
     while (len-- > 0) {
-        next += sprintf(next, "%2.2x", 0xff & *pdata++);
+        *next++ = simHexDigits[(*pdata >> 4) & 0xf];
+        *next++ = simHexDigits[*pdata++ & 0xf];
     }
     *next++ = '\n';
 
     dnpSend(pclient, block, next - block);
 }
 
+static void simWriteFrame(dnAsynClient *pclient, const char *pdata, int len) {
+    asynUser *pau = pclient->pau;
+    char frame[2+5+DN_RDDATA_LIMIT]; /* B <len:4>\n<data> */
+    int hlen;
+
+    asynPrint(pau, ASYN_TRACE_FLOW,
+        "simWriteFrame(%p, %p, %d)\n", pclient, pdata, len);
+
+    if (len > DN_RDDATA_LIMIT)
+        len = DN_RDDATA_LIMIT;
+
+    hlen = sprintf(frame, "B %4.4x\n", len);
+    memcpy(frame + hlen, pdata, len);
+
+    dnpSend(pclient, frame, hlen + len);
+}
+
+static void simSendData(dnAsynClient *pclient, const char *pdata, int len) {
+    int binary = (pclient->port->simMode == SIM_BINARY);
+    int blen = binary ? DN_RDDATA_LIMIT : 32;
+
+    do {
+        if (binary)
+            simWriteFrame(pclient, pdata, len);
+        else
+            simWriteMsg(pclient, pdata, len);
+        len -= blen;
+        pdata += blen;
+    } while (len > 0);
+}
+
+static int simGetBytes(dnAsynClient *pclient, char *pdata, int len) {
+    asynPrint(pclient->pau, ASYN_TRACE_FLOW,
+        "simGetBytes(%p, %p, %d)\n", pclient, pdata, len);
+
+    if (dnpGets(pclient, pdata, len)) {
+        asynPrint(pclient->pau, ASYN_TRACE_ERROR,
+            "simGetBytes: Data frame incomplete\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int simSkipBytes(dnAsynClient *pclient, int len) {
+    char discard[64];
+
+    while (len > 0) {
+        int blen = len > sizeof(discard) ? sizeof(discard) : len;
+
+        if (simGetBytes(pclient, discard, blen))
+            return -1;
+        len -= blen;
+    }
+    return 0;
+}
+
 static int simResponse(dnAsynClient *pclient) {
     asynUser *pau = pclient->pau;
     epicsTimeStamp T_end;
@@ -415,6 +1079,7 @@ static int simResponse(dnAsynClient *pclient) {
     case 'A':
     case 'X':
     case 'D':
+    case 'B':
         return reply;
 
     default:
@@ -432,11 +1097,7 @@ static int simWriteData(dnAsynClient *pclient, const char *pdata, int len) {
     asynPrint(pau, ASYN_TRACE_FLOW,
               "simWriteData(%p, %p, %d)\n", pclient, pdata, len);
 
-    do {
-        simWriteMsg(pclient, pdata, len);
-        len -= 32;
-        pdata += 32;
-    } while (len > 0);
+    simSendData(pclient, pdata, len);
 
     status = simResponse(pclient);
     if (status == 'A')
@@ -483,6 +1144,42 @@ static int simReadByte(dnAsynClient *pclient) {
     return val;
 }
 
+static int simReadFrame(dnAsynClient *pclient, char *pdata, int len, int *got) {
+    asynUser *pau = pclient->pau;
+    int hi, lo, blen, rlen, ch;
+
+    asynPrint(pau, ASYN_TRACE_FLOW,
+        "simReadFrame(%p, %p, %d)\n", pclient, pdata, len);
+
+    /* The 'B' has been read, the length is 4 hex digits then newline */
+    hi = simReadByte(pclient);
+    lo = hi < 0 ? -1 : simReadByte(pclient);
+    if (lo < 0)
+        return -1;
+    blen = (hi << 8) | lo;
+
+    do {
+        ch = dnpGetc(pclient);
+        if (ch < 0)
+            return ch;
+    } while (ch != '\n');
+
+    rlen = blen;
+    if (rlen > len) {
+        rlen = len;
+        asynPrint(pau, ASYN_TRACE_ERROR,
+            "simReadFrame: Requested %d bytes but reply is %d bytes!\n",
+            len, blen);
+    }
+
+    if (simGetBytes(pclient, pdata, rlen) ||
+        simSkipBytes(pclient, blen - rlen))
+        return -1;
+
+    *got += rlen;
+    return 'D';
+}
+
 static int simReadMsg(dnAsynClient *pclient, char *pdata, int len, int *got) {
     asynUser *pau = pclient->pau;
     epicsTimeStamp T_end;
@@ -495,6 +1192,8 @@ static int simReadMsg(dnAsynClient *pclient, char *pdata, int len, int *got) {
     epicsTimeAddSeconds(&T_end, pau->timeout);
 
     reply = simResponse(pclient);
+    if (reply == 'B')
+        return simReadFrame(pclient, pdata, len, got);
     if (reply != 'D')
         return reply;
 
@@ -619,32 +1318,106 @@ static int simReadData(dnAsynClient *pclient, char *pdata, int len) {
 }
 
 
+static void simNegotiate(dnAsynClient *pclient) {
+    asynUser *pau = pclient->pau;
+    int reply;
+
+    asynPrint(pau, ASYN_TRACE_FLOW,
+        "simNegotiate(%p)\n", pclient);
+
+    /* An older simulator may not reply at all */
+    pau->timeout = 2.0;
+    dnpFlush(pclient);
+    dnpSend(pclient, "M B\n", 4);
+
+    reply = simResponse(pclient);
+    if (reply == 'A') {
+        pclient->port->simMode = SIM_BINARY;
+        return;
+    }
+
+    asynPrint(pau, ASYN_TRACE_ERROR,
+        "simNegotiate: Binary mode refused, using ASCII\n");
+    pclient->port->simMode = SIM_ASCII;
+    dnpFlush(pclient);
+}
+
+/* The data encoding belongs to the connection, so it has to be negotiated
+ * again after the port reconnects */
+static void simCheckMode(dnAsynClient *pclient) {
+    dnPort *pport = pclient->port;
+    int nConnects = epicsAtomicGetIntT(&pport->nConnects);
+
+    if (pport->simConn != nConnects) {
+        pport->simConn = nConnects;
+        pport->simMode = pclient->simBinary ? SIM_ASK : SIM_ASCII;
+    }
+    if (pport->simMode == SIM_ASK)
+        simNegotiate(pclient);
+}
+
+
 /* Protocol interface routines for simulator */
 
+static void simMeasure(dnAsynClient *pclient, const epicsTimeStamp *pstart,
+    double timeout, int status)
+{
+    double elapsed = dnpElapsed(pstart);
+
+    /* Failures that came back in time still tell us the latency, but
+     * one that failed without getting a reply tells us nothing */
+    if (pclient->heard && elapsed < timeout)
+        dnpLatency(pclient->link, elapsed);
+    else if (status && elapsed >= timeout)
+        dnpMissed(pclient->link);
+}
+
 static int simWrite(dnAsynClient *pclient, int cmd, int addr,
     const char *pdata, int len)
 {
+    epicsTimeStamp T_start;
+    double timeout;
+    int status;
+
     asynPrint(pclient->pau, ASYN_TRACE_FLOW,
         "simWrite(%p, %d, %d, %p, %d)\n", pclient, cmd, addr, pdata, len);
 
-    pclient->pau->timeout = 20.0;
+    simCheckMode(pclient);
+
+    timeout = dnpTimeout(pclient->link, SIMDELAY);
+    pclient->pau->timeout = timeout;
+    epicsTimeGetCurrent(&T_start);
 
-    simCommand(pclient, cmd, addr, len);
+    simCommand(pclient, cmd, addr, len, -1);
 
-    return simWriteData(pclient, pdata, len);
+    status = simWriteData(pclient, pdata, len);
+    simMeasure(pclient, &T_start, timeout, status);
+    dncTime(pclient, dnPhaseData, &pclient->tMark);
+    return status;
 }
 
 static int simRead(dnAsynClient *pclient, int cmd, int addr,
     char *pdata, int len)
 {
+    epicsTimeStamp T_start;
+    double timeout;
+    int status;
+
     asynPrint(pclient->pau, ASYN_TRACE_FLOW,
         "simRead(%p, %d, %d, %p, %d)\n", pclient, cmd, addr, pdata, len);
 
-    pclient->pau->timeout = 20.0;
+    simCheckMode(pclient);
+
+    timeout = dnpTimeout(pclient->link, SIMDELAY);
+    pclient->pau->timeout = timeout;
+    epicsTimeGetCurrent(&T_start);
 
-    simCommand(pclient, cmd, addr, len);
+    simCommand(pclient, cmd, addr, len, -1);
 
-    return simReadData(pclient, pdata, len);
+    status = simReadData(pclient, pdata, len);
+    simMeasure(pclient, &T_start, timeout, status);
+    dncTime(pclient, dnPhaseData, &pclient->tMark);
+    return status;
 }
 
 const plcProto simProto = {
@@ -652,6 +1425,560 @@ const plcProto simProto = {
 };
 
 
+/* Asyn queue priorities */
+
+static asynQueuePriority dncPriority(int priority) {
+    switch (priority) {
+    case DN_PRIO_LOW:
+	return asynQueuePriorityLow;
+    case DN_PRIO_HIGH:
+	return asynQueuePriorityHigh;
+    default:
+	return asynQueuePriorityMedium;
+    }
+}
+
+/* Move a request that is still in the Asyn queue to a new priority.
+ * If the port has already taken it there is nothing to do. Returns
+ * non-zero if the request was cancelled but couldn't be queued again. */
+static int dncRequeue(asynUser *pau, int priority) {
+    int wasQueued = 0;
+    
+    if (pasynManager->cancelRequest(pau, &wasQueued) != asynSuccess ||
+	!wasQueued)
+	return 0;
+    if (pasynManager->queueRequest(pau, dncPriority(priority), 20.0)
+	    == asynSuccess)
+	return 0;
+    asynPrint(pau, ASYN_TRACE_ERROR,
+	      "dncRequeue: Can't queue request again: %s\n",
+	      pau->errorMessage);
+    return -1;
+}
+
+/* A request that dncRequeue() dropped must still complete, but not from
+ * inside dnAsynClientPriority(), whose caller may be in the middle of
+ * processing a record. */
+static void dncLostCallback(CALLBACK *pcb) {
+    dnAsynClient *pclient;
+    struct plcMessage *pMsg;
+    
+    callbackGetUser(pclient, pcb);
+    pMsg = (struct plcMessage *) pclient->pau->userPvt;
+    pMsg->callback(pMsg);
+}
+
+static void dncLost(dnAsynClient *pclient) {
+    struct plcMessage *pMsg = (struct plcMessage *) pclient->pau->userPvt;
+    
+    dncSetState(pclient, DNC_IDLE);
+    pMsg->status = DN_INTERNAL;
+    dncTrace(pMsg, DN_INTERNAL);
+    if (callbackRequest(&pclient->lost))
+	errlogPrintf("directNetClient: Request on Asyn port \"%s\" lost\n",
+		     pMsg->port);
+}
+
+/* Pipelined simulator protocol
+ *
+ * When pipelining has been enabled for an Asyn port, all the simulator
+ * clients on that port share a simPipe. Their messages are collected on
+ * the pipe's queue, and whenever the pipe's own asynUser gets the port it
+ * sends up to depth tagged requests before waiting for any replies, then
+ * dispatches each reply to its message using the tag. The simPipe also
+ * holds the other simulator settings for its port.
+ */
+
+#define SIM_TAGS 256
+
+typedef struct simTag {
+    struct plcMessage *pMsg;	/* NULL when the tag is free */
+    int got;			/* Read data received so far */
+    epicsTimeStamp start;
+    epicsTimeStamp deadline;
+} simTag;
+
+typedef struct simPipe {
+    struct simPipe *pNext;
+    const char *port;
+    int depth;			/* Max requests outstanding */
+    int binary;			/* Ask for binary data frames */
+    int nClients;
+    epicsMutexId mutex;		/* Protects queue .. running */
+    struct plcMessage *queue;
+    struct plcMessage **qtail;
+    int queued;			/* Request queued or callback running */
+    int running;		/* Callback running */
+    int priority;		/* Of the queued request */
+    CALLBACK lost;		/* Fails the queue if the request is dropped */
+    dnAsynClient client;
+    dnIo io;			/* For client */
+    int nOut;			/* Port thread only: nOut .. tags */
+    int nextTag;
+    simTag tags[SIM_TAGS];
+} simPipe;
+
+static simPipe *simPipes;
+
+static int simHexVal(int ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch + 10 - 'a';
+    if (ch >= 'A' && ch <= 'F')
+        return ch + 10 - 'A';
+    return -1;
+}
+
+static int simGetLine(dnAsynClient *pclient, char *buffer, int size) {
+    asynUser *pau = pclient->pau;
+    epicsTimeStamp T_end;
+    int len = 0;
+
+    epicsTimeGetCurrent(&T_end);
+    epicsTimeAddSeconds(&T_end, pau->timeout);
+
+    for (;;) {
+        epicsTimeStamp T_now;
+        int ch = dnpGetc(pclient);
+
+        if (ch < 0)
+            return ch;
+        if (ch == '\n' || ch == '\r') {
+            if (len)
+                break;
+        }
+        else if (len + 1 < size)
+            buffer[len++] = ch;
+
+        epicsTimeGetCurrent(&T_now);
+        pau->timeout = epicsTimeDiffInSeconds(&T_end, &T_now);
+        if (pau->timeout <= 0)
+            return -1;
+    }
+    buffer[len] = 0;
+    return len;
+}
+
+static void simPipeDone(simPipe *pipe, simTag *ptag, int status) {
+    struct plcMessage *pMsg = ptag->pMsg;
+
+    ptag->pMsg = NULL;
+    pipe->nOut--;
+    dncTime(pMsg->pClient, dnPhaseService, &ptag->start);
+    if (status == DN_TIMEOUT)
+        dnpMissed(pMsg->link);
+    else
+        dnpLatency(pMsg->link, dnpElapsed(&ptag->start));
+    dnpHealthUpdate(pMsg, status != DN_TIMEOUT);
+    dncTrace(pMsg, status);
+    dncSetState(pMsg->pClient, DNC_IDLE);
+    pMsg->status = status;
+    pMsg->callback(pMsg);
+}
+
+static void simPipeIssue(simPipe *pipe, struct plcMessage *pMsg) {
+    dnAsynClient *pclient = &pipe->client;
+    simTag *ptag;
+    int tag;
+
+    dncTime(pMsg->pClient, dnPhaseQueue, &pMsg->pClient->tQueued);
+    dncSetState(pMsg->pClient, DNC_ACTIVE);
+    if (pMsg->prepare && pMsg->prepare(pMsg)) {
+        /* Nothing to do after all */
+        dncSetState(pMsg->pClient, DNC_IDLE);
+        pMsg->status = DN_SUCCESS;
+        pMsg->callback(pMsg);
+        return;
+    }
+    if (dnpHealthCheck(pMsg->link)) {
+        dncTrace(pMsg, DN_PLC_DOWN);
+        dncSetState(pMsg->pClient, DNC_IDLE);
+        pMsg->status = DN_PLC_DOWN;
+        pMsg->callback(pMsg);
+        return;
+    }
+
+    /* There are always more tags than the maximum depth */
+    for (tag = pipe->nextTag; pipe->tags[tag].pMsg; tag = (tag + 1) % SIM_TAGS);
+    pipe->nextTag = (tag + 1) % SIM_TAGS;
+    ptag = &pipe->tags[tag];
+    ptag->pMsg = pMsg;
+    ptag->got = 0;
+    epicsTimeGetCurrent(&ptag->start);
+    ptag->deadline = ptag->start;
+    epicsTimeAddSeconds(&ptag->deadline, dnpTimeout(pMsg->link, SIMDELAY));
+    pipe->nOut++;
+    pMsg->pClient->phase = dnPhaseData;
+
+    simCommand(pclient, pMsg->cmd, pMsg->addr, pMsg->len, tag);
+    if (pMsg->cmd & WRITECMD)
+        simSendData(pclient, pMsg->pdata, pMsg->len);
+}
+
+static void simPipeExpire(simPipe *pipe) {
+    dnAsynClient *pclient = &pipe->client;
+    epicsTimeStamp T_now;
+    int tag, all = 1;
+
+    epicsTimeGetCurrent(&T_now);
+    for (tag = 0; tag < SIM_TAGS; tag++) {
+        simTag *ptag = &pipe->tags[tag];
+        if (ptag->pMsg && !epicsTimeLessThan(&T_now, &ptag->deadline))
+            all = 0;
+    }
+
+    /* Cancel the expired requests, or all of them after an I/O error */
+    for (tag = 0; tag < SIM_TAGS; tag++) {
+        simTag *ptag = &pipe->tags[tag];
+        char cancel[2+3+1+1];
+
+        if (!ptag->pMsg ||
+            (!all && epicsTimeLessThan(&T_now, &ptag->deadline)))
+            continue;
+
+        asynPrint(pclient->pau, ASYN_TRACE_ERROR,
+            "simPipeExpire: Request %2.2x timed out, cancelling\n", tag);
+        sprintf(cancel, "X %2.2x\n", tag);
+        dnpSend(pclient, cancel, strlen(cancel));
+        simPipeDone(pipe, ptag, DN_TIMEOUT);
+    }
+}
+
+static void simPipeReply(simPipe *pipe) {
+    dnAsynClient *pclient = &pipe->client;
+    asynUser *pau = pclient->pau;
+    epicsTimeStamp T_now, *pfirst = NULL;
+    struct plcMessage *pMsg;
+    simTag *ptag;
+    char line[80], *next;
+    int tag, status, blen = 0;
+
+    /* Wait no longer than the earliest deadline */
+    for (tag = 0; tag < SIM_TAGS; tag++) {
+        ptag = &pipe->tags[tag];
+        if (ptag->pMsg &&
+            (!pfirst || epicsTimeLessThan(&ptag->deadline, pfirst)))
+            pfirst = &ptag->deadline;
+    }
+    epicsTimeGetCurrent(&T_now);
+    pau->timeout = epicsTimeDiffInSeconds(pfirst, &T_now);
+
+    if (pau->timeout <= 0 ||
+        simGetLine(pclient, line, sizeof(line)) < 0) {
+        simPipeExpire(pipe);
+        return;
+    }
+
+    tag = strtol(&line[1], &next, 16);
+    if (line[0] == 'B')
+        blen = strtol(next, &next, 16);
+    if (next == &line[1] || tag < 0 || tag >= SIM_TAGS || blen < 0) {
+        asynPrint(pau, ASYN_TRACE_ERROR,
+            "simPipeReply: Bad reply '%s'\n", line);
+        dnpFlush(pclient);
+        return;
+    }
+    ptag = &pipe->tags[tag];
+    pMsg = ptag->pMsg;
+    if (!pMsg) {
+        /* Probably a late reply to a cancelled request */
+        asynPrint(pau, ASYN_TRACE_FLOW,
+            "simPipeReply: Discarding '%s'\n", line);
+        pau->timeout = SIMDELAY;
+        simSkipBytes(pclient, blen);
+        return;
+    }
+
+    switch (line[0]) {
+    case 'A':
+        status = (pMsg->cmd & WRITECMD) ? DN_SUCCESS : DN_RDBLK_FAIL;
+        break;
+
+    case 'N':
+        while (*next == ' ')
+            next++;
+        asynPrint(pau, ASYN_TRACE_ERROR,
+            "simPipeReply: Received NAK %2.2x '%s'\n", tag, next);
+        status = (pMsg->cmd & WRITECMD) ? DN_WRBLK_FAIL : DN_RDBLK_FAIL;
+        break;
+
+    case 'D': {
+        int blen = strtol(next, &next, 16);
+
+        while (*next == ' ')
+            next++;
+        status = DN_SUCCESS;
+        while (blen-- > 0) {
+            int hi = simHexVal(next[0]);
+            int lo = hi < 0 ? -1 : simHexVal(next[1]);
+
+            if (lo < 0 || (pMsg->cmd & WRITECMD)) {
+                asynPrint(pau, ASYN_TRACE_ERROR,
+                    "simPipeReply: Bad data message for %2.2x\n", tag);
+                status = DN_RDBLK_FAIL;
+                break;
+            }
+            if (ptag->got < pMsg->len)
+                pMsg->pdata[ptag->got++] = (hi << 4) | lo;
+            next += 2;
+        }
+        if (status == DN_SUCCESS && ptag->got < pMsg->len)
+            return;         /* More to come */
+        break;
+    }
+
+    case 'B': {
+        int rlen = pMsg->len - ptag->got;
+
+        if (rlen > blen || (pMsg->cmd & WRITECMD))
+            rlen = blen;
+        pau->timeout = SIMDELAY;
+        if (pMsg->cmd & WRITECMD) {
+            asynPrint(pau, ASYN_TRACE_ERROR,
+                "simPipeReply: Bad data frame for %2.2x\n", tag);
+            simSkipBytes(pclient, blen);
+            status = DN_WRBLK_FAIL;
+            break;
+        }
+        if (simGetBytes(pclient, pMsg->pdata + ptag->got, rlen) ||
+            simSkipBytes(pclient, blen - rlen)) {
+            status = DN_RDBLK_FAIL;
+            break;
+        }
+        ptag->got += rlen;
+        if (ptag->got < pMsg->len)
+            return;         /* More to come */
+        status = DN_SUCCESS;
+        break;
+    }
+
+    default:
+        asynPrint(pau, ASYN_TRACE_ERROR,
+            "simPipeReply: Unknown response '%s'\n", line);
+        return;
+    }
+
+    simPipeDone(pipe, ptag, status);
+}
+
+static void simPipeCallback(asynUser *pau) {
+    simPipe *pipe = (simPipe *) pau->userPvt;
+    asynPrint(pau, ASYN_TRACE_FLOW,
+        "simPipeCallback(%p)\n", pau);
+
+    epicsMutexMustLock(pipe->mutex);
+    pipe->running = 1;
+    epicsMutexUnlock(pipe->mutex);
+
+    pipe->client.io->rxHead = pipe->client.io->rxTail = 0;
+    simCheckMode(&pipe->client);
+
+    for (;;) {
+        struct plcMessage *pMsg = NULL;
+
+        epicsMutexMustLock(pipe->mutex);
+        if (pipe->nOut < pipe->depth && pipe->queue) {
+            pMsg = pipe->queue;
+            pipe->queue = pMsg->pNext;
+            if (!pipe->queue)
+                pipe->qtail = &pipe->queue;
+        }
+        else if (pipe->nOut == 0) {
+            /* Queue is empty too */
+            pipe->queued = 0;
+            pipe->running = 0;
+            epicsMutexUnlock(pipe->mutex);
+            return;
+        }
+        epicsMutexUnlock(pipe->mutex);
+
+        if (pMsg)
+            simPipeIssue(pipe, pMsg);
+        else
+            simPipeReply(pipe);
+    }
+}
+
+static void simPipeTimeout(asynUser *pau) {
+    simPipe *pipe = (simPipe *) pau->userPvt;
+    struct plcMessage *pMsg;
+    asynPrint(pau, ASYN_TRACE_FLOW,
+        "simPipeTimeout(%p)\n", pau);
+
+    epicsMutexMustLock(pipe->mutex);
+    pMsg = pipe->queue;
+    pipe->queue = NULL;
+    pipe->qtail = &pipe->queue;
+    pipe->queued = 0;
+    epicsMutexUnlock(pipe->mutex);
+
+    while (pMsg) {
+        struct plcMessage *pNext = pMsg->pNext;
+
+        dncTrace(pMsg, DN_TIMEOUT);
+        dncSetState(pMsg->pClient, DNC_IDLE);
+        pMsg->status = DN_TIMEOUT;
+        pMsg->callback(pMsg);
+        pMsg = pNext;
+    }
+}
+
+static void simPipeLost(CALLBACK *pcb) {
+    simPipe *pipe;
+
+    callbackGetUser(pipe, pcb);
+    simPipeTimeout(pipe->client.pau);
+}
+
+static int simPipeSend(simPipe *pipe, struct plcMessage *pMsg) {
+    asynStatus status = asynSuccess;
+    struct plcMessage **ppMsg;
+    int requeue = 0;
+
+    /* Keep the queue in priority order, first come first served within
+     * each priority */
+    epicsMutexMustLock(pipe->mutex);
+    ppMsg = &pipe->queue;
+    while (*ppMsg && (*ppMsg)->priority >= pMsg->priority)
+        ppMsg = &(*ppMsg)->pNext;
+    pMsg->pNext = *ppMsg;
+    *ppMsg = pMsg;
+    if (!pMsg->pNext)
+        pipe->qtail = &pMsg->pNext;
+
+    if (!pipe->queued) {
+        pipe->priority = pMsg->priority;
+        status = pasynManager->queueRequest(pipe->client.pau,
+            dncPriority(pipe->priority), 20.0);
+        if (status == asynSuccess)
+            pipe->queued = 1;
+        else {
+            /* The queue was empty before */
+            pipe->queue = NULL;
+            pipe->qtail = &pipe->queue;
+        }
+    }
+    else if (pMsg->priority > pipe->priority) {
+        pipe->priority = pMsg->priority;
+        /* A running callback will find this message in its loop */
+        requeue = !pipe->running;
+    }
+    epicsMutexUnlock(pipe->mutex);
+
+    /* Re-queuing waits for the callback, which takes the mutex. If the
+     * request gets dropped, fail the queue from a callback thread */
+    if (requeue && dncRequeue(pipe->client.pau, pMsg->priority) &&
+        callbackRequest(&pipe->lost))
+        errlogPrintf("directNetClient: Requests on Asyn port \"%s\" lost\n",
+            pipe->port);
+    return status;
+}
+
+static simPipe * simPipeFind(const char *port) {
+    simPipe *pipe;
+
+    for (pipe = simPipes; pipe; pipe = pipe->pNext) {
+        if (strcmp(pipe->port, port) == 0)
+            return pipe;
+    }
+    return NULL;
+}
+
+static simPipe * simPipeGet(const char *port) {
+    simPipe *pipe = simPipeFind(port);
+
+    if (pipe)
+        return pipe;
+
+    pipe = (simPipe *) calloc(1, sizeof(simPipe));
+    if (pipe == NULL) {
+        errlogPrintf("directNetClient: calloc failed for port \"%s\"\n",
+            port);
+        return NULL;
+    }
+    pipe->port = port;
+    pipe->mutex = epicsMutexMustCreate();
+    pipe->qtail = &pipe->queue;
+    callbackSetCallback(simPipeLost, &pipe->lost);
+    callbackSetPriority(priorityHigh, &pipe->lost);
+    callbackSetUser(pipe, &pipe->lost);
+    pipe->client.io = &pipe->io;
+    pipe->pNext = simPipes;
+    simPipes = pipe;
+    return pipe;
+}
+
+static int simPipeAttach(dnAsynClient *pclient, const char *port) {
+    simPipe *pipe = simPipeFind(port);
+    asynUser *pau;
+    asynInterface *pif;
+
+    if (!pipe)
+        return 0;
+
+    pipe->nClients++;
+    pclient->simBinary = pipe->binary;
+    if (pipe->depth <= 0)
+        return 0;
+
+    if (!pipe->client.pau) {
+        pau = pasynManager->createAsynUser(simPipeCallback, simPipeTimeout);
+        pau->userPvt = pipe;
+        if (pasynManager->connectDevice(pau, port, 0) != asynSuccess) {
+            errlogPrintf("initDnAsynClient: Can't connect to Asyn port \"%s\":\n\t%s \n",
+                port, pau->errorMessage);
+            pasynManager->freeAsynUser(pau);
+            return -1;
+        }
+        pif = pasynManager->findInterface(pau, asynOctetType, 1);
+        if (pif == NULL) {
+            pasynManager->disconnect(pau);
+            pasynManager->freeAsynUser(pau);
+            return -1;
+        }
+        pipe->client.pau = pau;
+        pipe->client.poctet = (asynOctet *) pif->pinterface;
+        pipe->client.drvPvt = pif->drvPvt;
+        pipe->client.port = pclient->port;
+        pipe->client.simBinary = pclient->simBinary;
+    }
+    pclient->pipe = pipe;
+    return 0;
+}
+
+int dnAsynClientPipeline(const char *port, int depth) {
+    simPipe *pipe;
+
+    if (depth < 0 || depth > DN_PIPE_MAX) {
+        printf("dnAsynClientPipeline: Depth must be 0 .. %d\n", DN_PIPE_MAX);
+        return -1;
+    }
+    pipe = simPipeGet(port);
+    if (!pipe)
+        return -1;
+    if (pipe->nClients) {
+        printf("dnAsynClientPipeline: Port \"%s\" is already in use\n", port);
+        return -1;
+    }
+    pipe->depth = depth;
+    return 0;
+}
+
+int dnAsynClientSimBinary(const char *port, int binary) {
+    simPipe *pipe = simPipeGet(port);
+
+    if (!pipe)
+        return -1;
+    if (pipe->nClients) {
+        printf("dnAsynClientSimBinary: Port \"%s\" is already in use\n", port);
+        return -1;
+    }
+    pipe->binary = binary;
+    return 0;
+}
+
+
 /* Asyn callback routines */
 
 static void dncQueueCallback(asynUser *pau) {
@@ -661,13 +1988,33 @@ static void dncQueueCallback(asynUser *pau) {
     asynPrint(pau, ASYN_TRACE_FLOW,
 	      "dncQueueCallback(%p)\n", pau);
     
-    if (pMsg->cmd & WRITECMD) {
-	pMsg->status = proto->write(pclient,
-	    pMsg->cmd, pMsg->addr, pMsg->pdata, pMsg->len);
-    } else {
-	pMsg->status = proto->read(pclient,
-	    pMsg->cmd, pMsg->addr, pMsg->pdata, pMsg->len);
-    }
+    /* Anything left over from our last transaction is stale */
+    pclient->io->rxHead = pclient->io->rxTail = 0;
+    pclient->heard = 0;
+    dncTime(pclient, dnPhaseQueue, &pclient->tQueued);
+    dncSetState(pclient, DNC_ACTIVE);
+    
+    if (pMsg->prepare && pMsg->prepare(pMsg)) {
+	/* Nothing to do after all */
+	pMsg->status = DN_SUCCESS;
+    } else if ((pMsg->status = dnpHealthCheck(pMsg->link)) == DN_SUCCESS) {
+	epicsTimeStamp T_start = pclient->tMark;
+	
+	if (pMsg->cmd & WRITECMD) {
+	    pMsg->status = proto->write(pclient,
+		pMsg->cmd, pMsg->addr, pMsg->pdata, pMsg->len);
+	} else {
+	    pMsg->status = proto->read(pclient,
+		pMsg->cmd, pMsg->addr, pMsg->pdata, pMsg->len);
+	}
+	/* Any reply at all shows the PLC is there */
+	dnpHealthUpdate(pMsg,
+	    pMsg->status == DN_SUCCESS || pclient->heard);
+	dncTime(pclient, dnPhaseService, &T_start);
+	dncTrace(pMsg, pMsg->status);
+    } else
+	dncTrace(pMsg, pMsg->status);
+    dncSetState(pclient, DNC_IDLE);
     pMsg->callback(pMsg);
 }
 
@@ -676,48 +2023,81 @@ static void dncQueueTimeout(asynUser *pau) {
     asynPrint(pau, ASYN_TRACE_FLOW,
 	      "dncQueueTimeout(%p)\n", pau);
     
+    dncTrace(pMsg, DN_TIMEOUT);
+    dncSetState(pMsg->pClient, DNC_IDLE);
     pMsg->status = DN_TIMEOUT;
     pMsg->callback(pMsg);
 
 }
 
 static void dncException(asynUser *pau, asynException why) {
-    struct plcMessage* pMsg = (struct plcMessage*) pau->userPvt;
+    dnConn *conn = (dnConn *) pau->userPvt;
+    dnAsynClient *pclient;
+    int connected;
     asynPrint(pau, ASYN_TRACE_FLOW,
 	      "dncException(%p)\n", pau);
     
-    if (why == asynExceptionConnect && pMsg->connstat) {
-	int connected;
-	pasynManager->isConnected(pau, &connected);
-	pMsg->connstat(pMsg, connected);
+    if (why != asynExceptionConnect) return;
+    pasynManager->isConnected(pau, &connected);
+    /* The port thread drops any session and renegotiates the simulator
+     * encoding when it sees this change */
+    if (conn->port)
+	epicsAtomicIncrIntT(&conn->port->nConnects);
+    
+    /* Clients are only ever added at the head of the list */
+    epicsMutexMustLock(dnPortLock);
+    pclient = conn->clients;
+    epicsMutexUnlock(dnPortLock);
+    for (; pclient; pclient = pclient->connNext) {
+	struct plcMessage *pMsg = (struct plcMessage *) pclient->pau->userPvt;
+	
+	if (pMsg->connstat)
+	    pMsg->connstat(pMsg, connected);
     }
 }
 
-/* Exported routines */
-
-int initDnAsynClient(struct plcMessage* pMsg) {
-    dnAsynClient *pclient;
+/* Connections
+ *
+ * All the clients for one PLC on a port share a dnConn, which holds the
+ * port's octet interface, the only exception callback and the I/O buffers;
+ * the port thread runs just one of their transactions at a time. Each
+ * client still needs its own asynUser, a duplicate of the dnConn's, since
+ * asyn only lets an asynUser have one request queued and every client's
+ * message is queued independently. The client structures are taken from
+ * blocks owned by the dnConn, another block being added whenever they run
+ * out. A message without a plcLink gets a dnConn of its own.
+ */
+
+#define DN_CONN_CLIENTS 2	/* Block size: a PLC's reads and writes */
+
+static dnConn *dnConns;		/* Shared ones, protected by dnPortLock */
+
+static dnConn * dncConnGet(struct plcMessage *pMsg) {
+    dnPort *pport = dncPortGet(pMsg->port);
+    dnConn *conn = NULL;
     asynUser *pau;
-    asynStatus status;
     asynInterface *pif;
-
-    if (!pMsg->proto) {
-        errlogPrintf("initDnAsynClient: Protocol pointer not set\n");
-        goto err_return;
+    asynStatus status;
+    
+    if (!pport)
+	return NULL;
+    
+    epicsMutexMustLock(dnPortLock);
+    if (pMsg->link) {
+	for (conn = dnConns; conn; conn = conn->pNext) {
+	    if (conn->link == pMsg->link && conn->port == pport)
+		goto done;
+	}
     }
-
-    pclient = (dnAsynClient *) calloc(1, sizeof(dnAsynClient));
-    if (pclient == NULL) {
+    
+    conn = (dnConn *) calloc(1, sizeof(dnConn));
+    if (conn == NULL) {
 	errlogPrintf("initDnAsynClient: calloc failed\n");
-	goto err_return;
+	goto done;
     }
     
-    pau = pasynManager->createAsynUser(dncQueueCallback, dncQueueTimeout);
-    asynPrint(pau, ASYN_TRACE_FLOW,
-	      "initDnAsynClient(%p)\n", pMsg);
-    pau->userPvt = pMsg;
-    pclient->pau = pau;
-    
+    pau = pasynManager->createAsynUser(NULL, NULL);
+    pau->userPvt = conn;
     status = pasynManager->connectDevice(pau, pMsg->port, 0);
     if (status != asynSuccess) {
 	errlogPrintf("initDnAsynClient: Can't connect to Asyn port \"%s\":\n\t%s \n",
@@ -731,8 +2111,8 @@ int initDnAsynClient(struct plcMessage* pMsg) {
 		     asynOctetType, pMsg->port);
 	goto err_disconnect;
     }
-    pclient->poctet = (asynOctet *) pif->pinterface;
-    pclient->drvPvt = pif->drvPvt;
+    conn->poctet = (asynOctet *) pif->pinterface;
+    conn->drvPvt = pif->drvPvt;
     
     status = pasynManager->exceptionCallbackAdd(pau, dncException);
     if (status != asynSuccess) {
@@ -741,14 +2121,110 @@ int initDnAsynClient(struct plcMessage* pMsg) {
 	/* Not a severe error, so don't give up */
     }
     
-    pMsg->pClient = pclient;
-    return 0;
+    conn->pau = pau;
+    conn->port = pport;
+    conn->link = pMsg->link;
+    if (conn->link) {
+	conn->pNext = dnConns;
+	dnConns = conn;
+    }
+    goto done;
 
 err_disconnect:
     pasynManager->disconnect(pau);
 err_freeAsynUser:
     pasynManager->freeAsynUser(pau);
-    free(pclient);
+    free(conn);
+    conn = NULL;
+done:
+    epicsMutexUnlock(dnPortLock);
+    return conn;
+}
+
+/* Caller must hold dnPortLock */
+static dnAsynClient * dncConnAlloc(dnConn *conn) {
+    dnAsynClient *pclient = conn->free;
+    
+    if (pclient) {
+	conn->free = pclient->connNext;
+    } else {
+	int n = conn->link ? DN_CONN_CLIENTS : 1;
+	
+	pclient = (dnAsynClient *) calloc(n, sizeof(dnAsynClient));
+	if (pclient == NULL)
+	    return NULL;
+	while (--n > 0) {
+	    pclient[n].connNext = conn->free;
+	    conn->free = &pclient[n];
+	}
+    }
+    pclient->connNext = NULL;
+    return pclient;
+}
+
+/* Exported routines */
+
+int initDnAsynClient(struct plcMessage* pMsg) {
+    dnConn *conn;
+    dnAsynClient *pclient;
+    asynUser *pau;
+
+    if (!pMsg->proto) {
+        errlogPrintf("initDnAsynClient: Protocol pointer not set\n");
+        goto err_return;
+    }
+
+    conn = dncConnGet(pMsg);
+    if (conn == NULL)
+	goto err_return;
+    
+    epicsMutexMustLock(dnPortLock);
+    pclient = dncConnAlloc(conn);
+    epicsMutexUnlock(dnPortLock);
+    if (pclient == NULL) {
+	errlogPrintf("initDnAsynClient: calloc failed\n");
+	goto err_return;
+    }
+    
+    pau = pasynManager->duplicateAsynUser(conn->pau,
+	dncQueueCallback, dncQueueTimeout);
+    asynPrint(pau, ASYN_TRACE_FLOW,
+	      "initDnAsynClient(%p)\n", pMsg);
+    pau->userPvt = pMsg;
+    pclient->pau = pau;
+    pclient->poctet = conn->poctet;
+    pclient->drvPvt = conn->drvPvt;
+    pclient->io = &conn->io;
+    pclient->conn = conn;
+    pclient->port = conn->port;
+    callbackSetCallback(dncLostCallback, &pclient->lost);
+    callbackSetPriority(priorityHigh, &pclient->lost);
+    callbackSetUser(pclient, &pclient->lost);
+    
+    if (pMsg->proto == &simProto &&
+        simPipeAttach(pclient, pMsg->port)) {
+	errlogPrintf("initDnAsynClient: Can't set up pipeline for Asyn port \"%s\"\n",
+		     pMsg->port);
+	goto err_freeClient;
+    }
+    
+    pclient->link = pMsg->link;
+    pMsg->pClient = pclient;
+    
+    epicsMutexMustLock(dnPortLock);
+    pclient->connNext = conn->clients;
+    conn->clients = pclient;
+    epicsMutexUnlock(dnPortLock);
+    return 0;
+
+err_freeClient:
+    pasynManager->disconnect(pau);
+    pasynManager->freeAsynUser(pau);
+    epicsMutexMustLock(dnPortLock);
+    memset(pclient, 0, sizeof(dnAsynClient));
+    pclient->connNext = conn->free;
+    conn->free = pclient;
+    epicsMutexUnlock(dnPortLock);
 err_return:
     return -1;
 }
@@ -761,7 +2237,140 @@ int dnAsynClientSend(struct plcMessage *pMsg) {
 	      "dnAsynClientSend(%p)\n", pMsg);
     
     pMsg->status = DN_INTERNAL;
+    epicsTimeGetCurrent(&pclient->tQueued);
+    pclient->phase = dnPhaseQueue;
+    pclient->retries = 0;
+    dncSetState(pclient, DNC_QUEUED);
     
-    status = pasynManager->queueRequest(pau, asynQueuePriorityMedium, 20.0);
+    if (pclient->pipe)
+	status = simPipeSend(pclient->pipe, pMsg);
+    else
+	status = pasynManager->queueRequest(pau, dncPriority(pMsg->priority),
+					    20.0);
+    if (status != asynSuccess)
+	dncSetState(pclient, DNC_IDLE);
     return status;
 }
+
+struct dnStats * dnAsynPortStats(const char *port) {
+    dnPort *pport = dncPortLookup(port);
+    
+    return pport ? &pport->stats : NULL;
+}
+
+struct dnBacklog * dnAsynPortBacklog(const char *port) {
+    dnPort *pport = dncPortLookup(port);
+    
+    return pport ? &pport->backlog : NULL;
+}
+
+/* Seconds the oldest request for the port, or just for one PLC if link
+ * is given, has been waiting in the queue */
+double dnAsynClientOldest(const char *port, const struct plcLink *link) {
+    dnPort *pport = dncPortLookup(port);
+    dnAsynClient *pclient;
+    epicsTimeStamp T_now;
+    double age = 0;
+    
+    if (!pport) return 0;
+    
+    epicsTimeGetCurrent(&T_now);
+    epicsMutexMustLock(pport->lock);
+    for (pclient = pport->qHead; pclient; pclient = pclient->qNext) {
+	if (!link || pclient->link == link) {
+	    age = epicsTimeDiffInSeconds(&T_now, &pclient->tQueued);
+	    break;
+	}
+    }
+    epicsMutexUnlock(pport->lock);
+    return age;
+}
+
+void dnAsynClientPriority(struct plcMessage *pMsg, int priority) {
+    dnAsynClient *pclient = pMsg->pClient;
+    asynPrint(pclient->pau, ASYN_TRACE_FLOW,
+	      "dnAsynClientPriority(%p, %d)\n", pMsg, priority);
+    
+    /* The caller may have raised pMsg->priority already */
+    if (priority > pMsg->priority)
+	pMsg->priority = priority;
+    
+    /* Pipelined requests are ordered in the pipe's queue when sent */
+    if (!pclient->pipe && dncRequeue(pclient->pau, pMsg->priority))
+	dncLost(pclient);
+}
+
+/* Print the last count trace records, or save them to a file for
+ * dnTraceDecode if file is given */
+int dnAsynTraceDump(int count, const char *file) {
+    static const char * const phaseNames[] = {
+	"queue", "select", "header", "data", "eot", "service"
+    };
+    char names[0xff][DN_TRACE_NAMELEN];
+    dnTraceRec *pbuf;
+    dnPort *pport;
+    int i, n, nPorts = 0;
+    
+    pbuf = (dnTraceRec *) calloc(DN_TRACE_SIZE, sizeof(dnTraceRec));
+    if (!pbuf) {
+	printf("dnAsynTraceDump: calloc failed\n");
+	return -1;
+    }
+    n = dncTraceCopy(pbuf, count);
+    
+    memset(names, 0, sizeof(names));
+    epicsThreadOnce(&dnPortOnce, dncPortInit, NULL);
+    epicsMutexMustLock(dnPortLock);
+    for (pport = dnPorts; pport; pport = pport->pNext) {
+	if (pport->index >= 0xff) continue;
+	strncpy(names[pport->index], pport->name, DN_TRACE_NAMELEN - 1);
+	if (pport->index >= nPorts)
+	    nPorts = pport->index + 1;
+    }
+    epicsMutexUnlock(dnPortLock);
+    
+    if (file && *file) {
+	FILE *fp = fopen(file, "wb");
+	dnTraceHdr hdr;
+	
+	if (!fp) {
+	    printf("dnAsynTraceDump: Can't create \"%s\"\n", file);
+	    free(pbuf);
+	    return -1;
+	}
+	memcpy(hdr.magic, DN_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = DN_TRACE_VERSION;
+	hdr.recSize = sizeof(dnTraceRec);
+	hdr.nPorts = nPorts;
+	hdr.nRecs = n;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(names, DN_TRACE_NAMELEN, nPorts, fp) != (size_t) nPorts ||
+	    fwrite(pbuf, sizeof(dnTraceRec), n, fp) != (size_t) n) {
+	    printf("dnAsynTraceDump: Error writing \"%s\"\n", file);
+	    n = -1;
+	}
+	if (fclose(fp)) n = -1;
+	free(pbuf);
+	return n < 0 ? -1 : 0;
+    }
+    
+    for (i = 0; i < n; i++) {
+	const dnTraceRec *prec = &pbuf[i];
+	epicsTimeStamp stamp;
+	char when[40];
+	
+	stamp.secPastEpoch = prec->secPastEpoch;
+	stamp.nsec = prec->nsec;
+	epicsTimeToStrftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S.%06f", &stamp);
+	printf("%s %s:%u %s 0x%02x addr=0x%04x len=%u %.3f ms %s retries=%u %s\n",
+	    when, prec->port < nPorts ? names[prec->port] : "?",
+	    prec->cmd >> 8, prec->cmd & WRITECMD ? "write" : "read",
+	    prec->cmd & 0xff, prec->addr, prec->len, prec->usecs / 1000.0,
+	    prec->phase < DN_PHASES ? phaseNames[prec->phase] : "?",
+	    prec->retries,
+	    prec->status >= 0 && prec->status <= DN_PLC_DOWN ?
+		dn_error_strings[prec->status] : "?");
+    }
+    free(pbuf);
+    return 0;
+}
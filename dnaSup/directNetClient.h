@@ -19,6 +19,9 @@ Version:
 #ifndef INC_directNetClient_H
 #define INC_directNetClient_H
 
+#include <stddef.h>
+
+#include <epicsTime.h>
 #include <shareLib.h>
 
 #ifdef __cplusplus
@@ -31,21 +34,108 @@ extern const char *dn_error_strings[];
 struct dnAsynClient;
 struct plcProto;
 
+/* Transaction timing, kept per PLC and per Asyn port. Bin i of a
+ * histogram counts times below DN_HIST_BASE * 2^i seconds, the last bin
+ * counts everything longer. All counters are updated atomically and only
+ * ever increase, so readers take differences between samples. */
+#define DN_HIST_BINS	16
+#define DN_HIST_BASE	0.00025
+
+enum dnPhase {
+    dnPhaseQueue,	/* Waiting for the Asyn port */
+    dnPhaseSelect,	/* Enquiry and select */
+    dnPhaseHeader,	/* Header and acknowledge */
+    dnPhaseData,	/* Data blocks, or whole simulator exchange */
+    dnPhaseEOT,		/* End of transmission */
+    dnPhaseService,	/* Everything after the queue wait */
+    DN_PHASES
+};
+
+struct dnHist {
+    size_t count;
+    size_t sumUs;		/* Total time in microseconds */
+    size_t bins[DN_HIST_BINS];
+};
+
+struct dnStats {
+    struct dnHist phase[DN_PHASES];
+    size_t txBytes;
+    size_t rxBytes;
+};
+
+/* Requests waiting for or using an Asyn port */
+struct dnBacklog {
+    int queued;			/* Waiting in the Asyn queue */
+    int inFlight;		/* Being processed */
+    int maxBacklog;		/* Largest queued + inFlight seen */
+};
+
+/* PLC health states */
+enum plcHealth { plcHealthy, plcSuspect, plcDown };
+
+/* Response latency estimate and health of one PLC, shared by all its
+ * messages. The client uses it to shorten the protocol's worst-case
+ * timeouts, and fails requests to a PLC that is down without sending
+ * them except for an occasional probe. */
+struct plcLink {
+    double mean;		/* Smoothed response latency, seconds */
+    double dev;			/* Smoothed mean deviation, seconds */
+    double tmoMin;		/* Shortest timeout to use, seconds */
+    double tmoMax;		/* Longest timeout, 0 = protocol limits */
+    unsigned long nSamples;	/* Responses measured */
+    unsigned long nTimeouts;	/* Responses missed */
+    unsigned int nMissed;	/* Consecutive misses */
+    enum plcHealth health;
+    unsigned int nFailed;	/* Consecutive transactions unanswered */
+    double probePeriod;		/* Seconds between probes, 0 = never down */
+    epicsTimeStamp nextProbe;	/* When down */
+    unsigned long nTrips;	/* Times marked down */
+    unsigned long nProbes;
+    unsigned long nFastFails;	/* Requests failed while down */
+    int session;		/* DirectNet: keep selected between requests */
+    unsigned long nResumed;	/* Transactions that didn't need a select */
+    struct dnStats stats;
+    struct dnBacklog backlog;
+};
+
+/* Request priorities, in increasing order */
+#define DN_PRIO_LOW	0	/* Background refresh */
+#define DN_PRIO_MEDIUM	1
+#define DN_PRIO_HIGH	2	/* Outputs and on-demand reads */
+
 struct plcMessage {
     const char *port;
     struct dnAsynClient *pClient;
+    struct plcMessage *pNext;	/* Private to directNetClient */
     const struct plcProto *proto;
+    struct plcLink *link;	/* Optional, enables adaptive timeouts */
+    int priority;		/* DN_PRIO_xxx, used when queued */
     int cmd;
     int addr;
     int len; /* in bytes */
     char *pdata;
     int status;
+    int (*prepare)(struct plcMessage *pPvt);	/* Optional, non-zero skips I/O */
+    int (*more)(struct plcMessage *pPvt);	/* Optional, non-zero if the
+						 * callback will resend it */
     void (*callback)(struct plcMessage *pPvt);
     void (*connstat)(struct plcMessage *pPvt, int connected);
 };
 
 epicsShareFunc int initDnAsynClient(struct plcMessage* pPlcMsg);
 epicsShareFunc int dnAsynClientSend(struct plcMessage *pPlcMsg);
+/* Re-queues a queued message at a higher priority. This waits for the
+ * message's callback if it is running, so the caller must not hold any lock
+ * that the message's prepare, more or callback routines take. */
+epicsShareFunc void dnAsynClientPriority(struct plcMessage *pPlcMsg,
+    int priority);
+epicsShareFunc int dnAsynClientPipeline(const char *port, int depth);
+epicsShareFunc int dnAsynClientSimBinary(const char *port, int binary);
+epicsShareFunc struct dnStats * dnAsynPortStats(const char *port);
+epicsShareFunc struct dnBacklog * dnAsynPortBacklog(const char *port);
+epicsShareFunc double dnAsynClientOldest(const char *port,
+    const struct plcLink *link);
+epicsShareFunc int dnAsynTraceDump(int count, const char *file);
 
 epicsShareExtern const struct plcProto dnpProto, simProto;
 
@@ -131,6 +131,8 @@ static void dniConnect(struct plcInteract **ppInt, const char *pname) {
 	
 	pInt->msg.port     = pPlc->port;
 	pInt->msg.proto    = pPlc->proto;
+	pInt->msg.link     = &pPlc->link;
+	pInt->msg.priority = DN_PRIO_MEDIUM;
 	pInt->msg.pdata    = pInt->rdData;
 	pInt->msg.callback = dniCallback;
 	
@@ -0,0 +1,56 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    dnTrace.h
+
+Description:
+    Binary transaction trace records and the file format they are saved in,
+    shared by directNetClient.c and the dnTraceDecode program.
+
+Author:
+    Andrew Johnson
+
+******************************************************************************/
+
+#ifndef INC_dnTrace_H
+#define INC_dnTrace_H
+
+#include <epicsTypes.h>
+
+/* A trace file starts with a dnTraceHdr, followed by nPorts port names of
+ * DN_TRACE_NAMELEN characters each, then nRecs dnTraceRec records from
+ * oldest to newest. Everything is in the byte order of the IOC that wrote
+ * it; a reader that sees version byte-swapped must swap all the fields.
+ */
+#define DN_TRACE_MAGIC		"DNTR"
+#define DN_TRACE_VERSION	1
+#define DN_TRACE_NAMELEN	40
+
+typedef struct dnTraceHdr {
+    char magic[4];
+    epicsUInt16 version;
+    epicsUInt16 recSize;	/* sizeof(dnTraceRec) */
+    epicsUInt32 nPorts;
+    epicsUInt32 nRecs;
+} dnTraceHdr;
+
+/* One completed (or failed) transaction */
+typedef struct dnTraceRec {
+    epicsUInt32 seq;		/* Transaction number, 0 while being written */
+    epicsUInt32 secPastEpoch;	/* EPICS time it finished */
+    epicsUInt32 nsec;
+    epicsUInt32 usecs;		/* From being sent to finishing */
+    epicsUInt16 cmd;		/* DirectNet command, slave ID in high byte */
+    epicsUInt16 addr;
+    epicsUInt16 len;
+    epicsUInt8 port;		/* Index into the port names */
+    epicsUInt8 phase;		/* Last phase reached, enum dnPhase */
+    epicsInt8 status;		/* DN_xxx status */
+    epicsUInt8 retries;		/* Failed attempts along the way */
+    epicsUInt16 spare;
+} dnTraceRec;
+
+#endif /* INC_dnTrace_H */
@@ -0,0 +1,141 @@
+/******************************************************************************
+
+Project:
+    DirectNet ASYN
+
+File:
+    dnTraceDecode.c
+
+Description:
+    Host program to print the transaction trace files saved by the IOC
+    command dnAsynTraceDump
+
+Author:
+    Andrew Johnson
+
+******************************************************************************/
+
+/* OS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* directNetAsyn */
+#include "directNetAsyn.h"
+#include "dnTrace.h"
+
+/* Seconds between the POSIX and EPICS epochs */
+#define EPICS_EPOCH 631152000u
+
+static const char * const phaseNames[] = {
+    "queue", "select", "header", "data", "eot", "service"
+};
+
+static const char * const statusNames[] = {
+    "DN_SUCCESS", "DN_INTERNAL", "DN_TIMEOUT", "DN_SEND_FAIL",
+    "DN_SEL_FAIL", "DN_HDR_FAIL", "DN_RDBLK_FAIL", "DN_WRBLK_FAIL",
+    "DN_NOT_EOT", "DN_GOT_EOT", "DN_PLC_DOWN"
+};
+
+#define NELEMENTS(array) (sizeof(array) / sizeof(array[0]))
+
+static epicsUInt16 swap16(epicsUInt16 val) {
+    return (val >> 8) | (val << 8);
+}
+
+static epicsUInt32 swap32(epicsUInt32 val) {
+    return (val >> 24) | ((val >> 8) & 0xff00) |
+	((val << 8) & 0xff0000) | (val << 24);
+}
+
+static int decode(const char *file) {
+    FILE *fp = fopen(file, "rb");
+    char (*names)[DN_TRACE_NAMELEN] = NULL;
+    dnTraceHdr hdr;
+    dnTraceRec rec;
+    epicsUInt32 i;
+    int swap;
+
+    if (!fp) {
+	fprintf(stderr, "dnTraceDecode: Can't open \"%s\"\n", file);
+	return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	memcmp(hdr.magic, DN_TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+	fprintf(stderr, "dnTraceDecode: \"%s\" is not a trace file\n", file);
+	fclose(fp);
+	return 1;
+    }
+    swap = (hdr.version != DN_TRACE_VERSION);
+    if (swap) {
+	hdr.version = swap16(hdr.version);
+	hdr.recSize = swap16(hdr.recSize);
+	hdr.nPorts = swap32(hdr.nPorts);
+	hdr.nRecs = swap32(hdr.nRecs);
+    }
+    if (hdr.version != DN_TRACE_VERSION || hdr.recSize != sizeof(rec)) {
+	fprintf(stderr, "dnTraceDecode: \"%s\" has unknown version %u\n",
+	    file, hdr.version);
+	fclose(fp);
+	return 1;
+    }
+
+    if (hdr.nPorts) {
+	names = calloc(hdr.nPorts, DN_TRACE_NAMELEN);
+	if (!names ||
+	    fread(names, DN_TRACE_NAMELEN, hdr.nPorts, fp) != hdr.nPorts) {
+	    fprintf(stderr, "dnTraceDecode: \"%s\" is truncated\n", file);
+	    free(names);
+	    fclose(fp);
+	    return 1;
+	}
+	for (i = 0; i < hdr.nPorts; i++)
+	    names[i][DN_TRACE_NAMELEN - 1] = 0;
+    }
+
+    for (i = 0; i < hdr.nRecs; i++) {
+	time_t secs;
+	char when[40];
+
+	if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+	    fprintf(stderr, "dnTraceDecode: \"%s\" is truncated\n", file);
+	    break;
+	}
+	if (swap) {
+	    rec.secPastEpoch = swap32(rec.secPastEpoch);
+	    rec.nsec = swap32(rec.nsec);
+	    rec.usecs = swap32(rec.usecs);
+	    rec.cmd = swap16(rec.cmd);
+	    rec.addr = swap16(rec.addr);
+	    rec.len = swap16(rec.len);
+	}
+
+	secs = (time_t) rec.secPastEpoch + EPICS_EPOCH;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+	printf("%s.%06u %s:%u %s 0x%02x addr=0x%04x len=%u %.3f ms %s retries=%u %s\n",
+	    when, (unsigned) (rec.nsec / 1000),
+	    rec.port < hdr.nPorts ? names[rec.port] : "?",
+	    rec.cmd >> 8, rec.cmd & WRITECMD ? "write" : "read",
+	    rec.cmd & 0xff, rec.addr, rec.len, rec.usecs / 1000.0,
+	    rec.phase < NELEMENTS(phaseNames) ? phaseNames[rec.phase] : "?",
+	    rec.retries,
+	    rec.status >= 0 && rec.status < (int) NELEMENTS(statusNames) ?
+		statusNames[rec.status] : "?");
+    }
+    free(names);
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int i, status = 0;
+
+    if (argc < 2) {
+	fprintf(stderr, "Usage: %s <trace file> ...\n", argv[0]);
+	return 1;
+    }
+    for (i = 1; i < argc; i++)
+	status |= decode(argv[i]);
+    return status;
+}